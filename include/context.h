@@ -11,7 +11,7 @@
 #include "globals.h"
 #include "object.h"
 #include "network/gamestate.h"
-
+#include <signal.h>
 #include <boost/thread.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
@@ -29,6 +29,7 @@ class LocalPlanner;
 class GlobalPlanner;
 class Dispatcher;
 class Grid;
+class GridCheckpointer;
 class DynamicMapper;
 
 class Context : public Object {
@@ -180,10 +181,11 @@ private:
     // Current map
     Map *m_map;
     Grid *m_grid;
+    GridCheckpointer *m_gridCheckpointer;
     DynamicMapper *m_dynamicMapper;
     
-    // Abort request flag
-    bool m_abort;
+    // Abort request flag, raised from the termination signal handler
+    volatile sig_atomic_t m_abort;
     
     // Planners
     LocalPlanner *m_localPlanner;
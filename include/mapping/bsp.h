@@ -173,6 +173,57 @@ typedef struct {
   long face[2];
 } edgeface_t;
 
+/**
+ * A read-only typed view of a single BSP lump. The view does not own
+ * the underlying memory, which usually belongs to a memory-mapped PAK
+ * datafile.
+ */
+template <typename T>
+class Lump {
+public:
+    /**
+     * Constructs an empty lump view.
+     */
+    Lump()
+      : m_data(0),
+        m_count(0)
+    {}
+    
+    /**
+     * Constructs a lump view.
+     *
+     * @param data Pointer to the first lump element
+     * @param count Number of elements in this lump
+     */
+    Lump(const void *data, int count)
+      : m_data(static_cast<const T*>(data)),
+        m_count(count)
+    {}
+    
+    /**
+     * Returns the element at the specified index.
+     */
+    inline const T &operator[](int index) const { return m_data[index]; }
+    
+    /**
+     * Returns a pointer to the first element.
+     */
+    inline const T *data() const { return m_data; }
+    
+    /**
+     * Returns the number of elements in this lump.
+     */
+    inline int size() const { return m_count; }
+    
+    /**
+     * Returns true if this lump contains no elements.
+     */
+    inline bool empty() const { return m_count == 0; }
+private:
+    const T *m_data;
+    int m_count;
+};
+
 }
 
 }
@@ -0,0 +1,99 @@
+/*
+ * This file is part of HiveMind distributed Quake 2 bot.
+ *
+ * Copyright (C) 2010 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2010 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ * Copyright (C) 2010 by Grega Kespret <grega.kespret@gmail.com>
+ */
+#ifndef HM_MAPPING_CHECKPOINT_H
+#define HM_MAPPING_CHECKPOINT_H
+
+#include "object.h"
+
+#include <boost/thread.hpp>
+
+namespace HiveMind {
+
+class Grid;
+
+enum {
+    CHECKPOINT_INTERVAL = 60000
+};
+
+/**
+ * Periodically saves the learned grid in the background so that what
+ * has been learned survives the bot. Bots sharing a data directory also
+ * share the grid file, which is only written by the bot holding a lock
+ * on it; other bots take over once that bot has stopped.
+ */
+class GridCheckpointer : public Object {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param grid Grid to save
+     * @param filename Output filename
+     * @param interval Time between checkpoints in milliseconds
+     */
+    GridCheckpointer(Grid *grid, const std::string &filename, int interval = CHECKPOINT_INTERVAL);
+    
+    /**
+     * Class destructor.
+     */
+    virtual ~GridCheckpointer();
+    
+    /**
+     * Starts the background checkpoint task.
+     */
+    void start();
+    
+    /**
+     * Stops the background checkpoint task and saves the grid one
+     * last time.
+     */
+    void stop();
+    
+    /**
+     * Saves the grid now when this checkpointer owns the output file.
+     * The grid is only locked while a snapshot is taken and the file is
+     * replaced atomically, so readers never see a partially written grid.
+     */
+    void checkpoint();
+protected:
+    /**
+     * Tries to become the only writer of the output file.
+     *
+     * @return True if this checkpointer owns the output file
+     */
+    bool acquireOwnership();
+    
+    /**
+     * Gives up the output file so that another bot can take it over.
+     */
+    void releaseOwnership();
+    
+    /**
+     * Background checkpoint task.
+     */
+    void process();
+private:
+    // Grid and output filename
+    Grid *m_grid;
+    std::string m_filename;
+    int m_interval;
+    
+    // Background worker thread
+    boost::thread m_workerThread;
+    bool m_running;
+    
+    // Serializes checkpoints from the worker and from stop
+    boost::mutex m_checkpointMutex;
+    
+    // Descriptor of the locked ownership file or -1 when not owned
+    int m_lockFd;
+};
+
+}
+
+#endif
+
@@ -9,8 +9,10 @@
 #define HM_MAPPING_EXPORTERS_H
 
 #include "mapping/grid.h"
+#include "mapping/gridformat.h"
 
 #include <fstream>
+#include <vector>
 
 namespace HiveMind {
 
@@ -74,6 +76,86 @@ private:
     boost::unordered_map<GridNode*, int> m_nodeIds;
 };
 
+/**
+ * An exporter for binary format that can be memory mapped on import. The
+ * grid is written to a temporary file which then replaces the output
+ * file, so the output is never left partially written.
+ */
+class BinaryGridExporter : public GridExporter {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param filename Output filename
+     */
+    BinaryGridExporter(const std::string &filename);
+    
+    /**
+     * This method is called on initialization.
+     *
+     * @param nodes Number of nodes that will be exported
+     */
+    void open(size_t nodes);
+    
+    /**
+     * This method is called for every waypoint.
+     *
+     * @param node Grid node associated with the waypoint
+     * @param wp Waypoint
+     */
+    void exportWaypoint(GridNode *node, const GridWaypoint &wp);
+    
+    /**
+     * This method is called for every grid node.
+     *
+     * @param node Grid node
+     */
+    void exportNode(GridNode *node);
+    
+    /**
+     * This method is called before links are exported.
+     */
+    void startLinks();
+    
+    /**
+     * This method is called for every link.
+     *
+     * @param node Source grid node
+     * @param link Grid link
+     */
+    void exportLink(GridNode *node, GridLink *link);
+    
+    /**
+     * This method is called after export has been completed.
+     */
+    void close();
+    
+    /**
+     * Returns true if the grid has been successfully written.
+     */
+    inline bool isWritten() const { return m_written; }
+private:
+    /**
+     * Releases the collected sections.
+     */
+    void clear();
+    
+    // Output filename
+    std::string m_filename;
+    bool m_written;
+    
+    // Sections are collected during export and written on close
+    std::vector<GridFormat::grid_node_t> m_nodes;
+    std::vector<GridFormat::grid_waypoint_t> m_waypoints;
+    std::vector<int> m_linkSources;
+    std::vector<GridFormat::grid_link_t> m_links;
+    std::vector<uint8_t> m_media;
+    std::vector<uint8_t> m_types;
+    
+    // For maintaining node identifiers during build
+    boost::unordered_map<GridNode*, int> m_nodeIds;
+};
+
 /**
  * An exporter for Pajek format to visualize the graph.
  */
@@ -13,12 +13,21 @@
 #include "kdtree/kdtree.hpp"
 #include "mapping/items.h"
 
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/foreach.hpp>
 #include <boost/random/mersenne_twister.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/unordered_set.hpp>
 
+#include <bitset>
+#include <cmath>
+#include <limits>
 #include <list>
 #include <set>
+#include <vector>
 
 namespace HiveMind {
 
@@ -27,10 +36,16 @@ class MapPath;
 class Grid;
 class GridLink;
 class GridNode;
+class GridSearch;
+class GridScratch;
+class GridRepairState;
 class Item;
 
 /**
- * This represents a waypoint.
+ * This represents a waypoint. Waypoints stored in lookup trees carry
+ * the index of what they point to (a grid node or a path position), so
+ * search results and predicates need no further lookups. The index is
+ * not part of waypoint identity.
  */
 class GridWaypoint {
 public:
@@ -38,14 +53,20 @@ public:
      * Class constructor.
      *
      * @param location Waypoint location
+     * @param index Index of the associated grid node or path position
      */
-    GridWaypoint(const Vector3f &location);
+    GridWaypoint(const Vector3f &location, int index = -1);
     
     /**
      * Returns waypoint coordinates.
      */
     inline Vector3f getLocation() const { return m_location; }
     
+    /**
+     * Returns the index of the associated grid node or path position.
+     */
+    inline int getIndex() const { return m_index; }
+    
     /**
      * Dimension accessor used by the kd-tree.
      *
@@ -88,12 +109,16 @@ public:
 private:
     // Waypoint location
     Vector3f m_location;
+    
+    // Associated grid node or path position
+    int m_index;
 };
 
 // Helper typedefs
 typedef boost::unordered_map<GridNode*, GridLink*> GridLinkMap;
 typedef std::set<GridWaypoint> GridWaypointSet;
 typedef boost::unordered_set<Item> ItemSet;
+typedef std::bitset<Item::BFG + 1> ItemTypeSet;
 
 /**
  * This represents a graph node that can contain multiple
@@ -123,8 +148,11 @@ public:
     
     /**
      * Class constructor.
+     *
+     * @param grid Grid instance
+     * @param id Node index in the grid
      */
-    GridNode(Grid *grid);
+    GridNode(Grid *grid, int id);
     
     /**
      * Class destructor.
@@ -136,6 +164,11 @@ public:
      */
     void addWaypoint(const GridWaypoint &p);
     
+    /**
+     * Returns this node's index in the grid.
+     */
+    inline int getId() const { return m_id; }
+    
     /**
      * Returns the central location of this grid node. This is
      * always the first waypoint.
@@ -179,7 +212,7 @@ public:
      *
      * @param medium New medium
      */
-    inline void setMedium(Medium medium) { m_medium = medium; }
+    void setMedium(Medium medium);
     
     /**
      * Returns the type of this grid node.
@@ -191,17 +224,22 @@ public:
      *
      * @param type New type
      */
-    inline void setType(Type type) { m_type = type; }
+    void setType(Type type);
+    
+    /**
+     * Marks this node as linked with the rest of the map.
+     */
+    void setLinked();
 
     /**
      * Returns the time when this GridNode was last visited.
      */
-    inline timestamp_t getLastVisit() { return m_lastVisit; }
+    timestamp_t getLastVisit() const;
 
     /**
      * Sets this grid node's last visit time to now.
      */
-    inline void updateLastVisit() { m_lastVisit = Timing::getCurrentTimestamp(); }
+    void updateLastVisit();
     
     /**
      * Adds a new item to this node.
@@ -242,12 +280,12 @@ private:
     Grid *m_grid;
     
     // Node attributes
+    int m_id;
     Vector3f m_location;
     GridWaypointSet m_waypoints;
     GridLinkMap m_links;
     Medium m_medium;
     Type m_type;
-    timestamp_t m_lastVisit;
     bool m_linked;
     
     // Item registry for this node
@@ -286,14 +324,257 @@ private:
     float m_rank;
 };
 
-// Grid KD tree and waypoint map
+// Grid KD tree
 typedef KDTree::KDTree<3, GridWaypoint, std::pointer_to_binary_function<GridWaypoint,size_t,float> > GridTree;
-typedef boost::unordered_map<GridWaypoint, int> GridWaypointIndexMap;
+
+/**
+ * A uniform spatial hash of waypoints. Space is divided into cubic cells
+ * and only cells around a location are visited by lookups, so inserts
+ * and lookups within a small radius take constant time and the hash
+ * never needs rebalancing. Cells are kept in buckets that copies of the
+ * hash share until a waypoint is inserted into them, so a copy with a
+ * few more waypoints only duplicates the buckets they fall into.
+ */
+class GridSpatialHash {
+public:
+    // Number of buckets cells are spread over
+    enum { bucket_count = 256 };
+    
+    /**
+     * Class constructor.
+     *
+     * @param cellSize Length of a cell edge
+     */
+    GridSpatialHash(float cellSize);
+    
+    /**
+     * Inserts a waypoint.
+     *
+     * @param wp Waypoint carrying its index
+     */
+    void insert(const GridWaypoint &wp);
+    
+    /**
+     * Removes all waypoints.
+     */
+    void clear();
+    
+    /**
+     * Returns the number of waypoints.
+     */
+    inline size_t size() const { return m_size; }
+    
+    /**
+     * Returns the index of the nearest waypoint within some radius.
+     *
+     * @param location Query location
+     * @param radius Search radius
+     * @return Waypoint index or -1 when there is no waypoint in range
+     */
+    int findNearest(const Vector3f &location, float radius) const;
+    
+    /**
+     * Returns the index of the nearest waypoint within some radius that
+     * satisfies a predicate.
+     *
+     * @param location Query location
+     * @param radius Search radius
+     * @param predicate Waypoint predicate
+     * @return Waypoint index or -1 when there is no waypoint in range
+     */
+    template <typename Predicate>
+    int findNearest(const Vector3f &location, float radius, Predicate predicate) const;
+private:
+    /**
+     * Returns the cell coordinate of a location component.
+     */
+    inline int cell(float x) const { return static_cast<int>(std::floor(x / m_cellSize)); }
+    
+    /**
+     * Returns the key of a cell.
+     */
+    static inline boost::uint64_t key(int x, int y, int z)
+    {
+      return (static_cast<boost::uint64_t>(x & 0x1FFFFF) << 42) |
+             (static_cast<boost::uint64_t>(y & 0x1FFFFF) << 21) |
+             static_cast<boost::uint64_t>(z & 0x1FFFFF);
+    }
+    
+    // Waypoints by cell key
+    typedef boost::unordered_map<boost::uint64_t, std::vector<GridWaypoint> > CellMap;
+    
+    /**
+     * Returns the bucket holding a cell or NULL when it is empty.
+     */
+    inline const CellMap *bucket(boost::uint64_t key) const
+    {
+      return m_buckets[boost::hash_value(key) % bucket_count].get();
+    }
+    
+    // Cell size
+    float m_cellSize;
+    
+    // Buckets of cells, possibly shared with copies of this hash
+    std::vector<boost::shared_ptr<CellMap> > m_buckets;
+    size_t m_size;
+};
+
+template <typename Predicate>
+int GridSpatialHash::findNearest(const Vector3f &location, float radius, Predicate predicate) const
+{
+  int cx = cell(location[0]), cy = cell(location[1]), cz = cell(location[2]);
+  int rings = static_cast<int>(std::ceil(radius / m_cellSize));
+  int best = -1;
+  float bestDistance = radius;
+  
+  for (int r = 0; r <= rings; r++) {
+    // Cells in this ring are at least (r - 1) cells away, so the search
+    // is done once something closer has been found
+    if (best != -1 && (r - 1) * m_cellSize >= bestDistance)
+      break;
+    
+    for (int dx = -r; dx <= r; dx++) {
+      for (int dy = -r; dy <= r; dy++) {
+        // Only the outer shell of the ring has not been visited yet
+        bool inner = dx != -r && dx != r && dy != -r && dy != r;
+        for (int dz = -r; dz <= r; dz += (inner && r > 0) ? 2 * r : 1) {
+          boost::uint64_t k = key(cx + dx, cy + dy, cz + dz);
+          const CellMap *cells = bucket(k);
+          if (!cells)
+            continue;
+          
+          CellMap::const_iterator i = cells->find(k);
+          if (i == cells->end())
+            continue;
+          
+          BOOST_FOREACH(const GridWaypoint &wp, i->second) {
+            float distance = (wp.getLocation() - location).norm();
+            if (distance <= bestDistance && (best == -1 || distance < bestDistance) && predicate(wp)) {
+              best = wp.getIndex();
+              bestDistance = distance;
+            }
+          }
+        }
+      }
+    }
+  }
+  
+  return best;
+}
+
+/**
+ * An item known to the grid together with the node holding it.
+ */
+struct GridItem {
+    GridItem(const Item &item, GridNode *node) : item(item), node(node) {}
+    
+    // Item and its node
+    Item item;
+    GridNode *node;
+};
+
+/**
+ * A spatial index of items of all types. Waypoints in the tree carry
+ * slot indices of item entries, so lookups can filter by type and
+ * expiry without keeping a separate tree for each item type.
+ */
+class GridItemIndex {
+public:
+    // Radius of the first shell searched by nearest item lookups
+    enum { shell_radius = 512 };
+    
+    /**
+     * Class constructor.
+     */
+    GridItemIndex();
+    
+    /**
+     * Registers an item or refreshes the last seen time of an already
+     * registered one.
+     *
+     * @param item Item
+     * @param node Node holding the item
+     * @return True if the item has not been registered before
+     */
+    bool insert(const Item &item, GridNode *node);
+    
+    /**
+     * Removes an item from the index. The tree is rebalanced once
+     * enough items have been removed.
+     *
+     * @param item Item
+     * @return True if the item has been registered
+     */
+    bool erase(const Item &item);
+    
+    /**
+     * Removes all items.
+     */
+    void clear();
+    
+    /**
+     * Returns the number of registered items.
+     */
+    inline size_t size() const { return m_slots.size(); }
+    
+    /**
+     * Finds the nearest items of some types ordered by distance. Shells
+     * of doubling radius are searched until enough items are found, so
+     * far away items are only visited when nothing is near.
+     *
+     * @param origin Query location
+     * @param types Wanted item types
+     * @param count Maximum number of items
+     * @param since Items last seen before this time are skipped unless
+     *              they are persistent
+     * @param radius Search radius
+     * @param items Output vector for found items
+     * @return Number of found items
+     */
+    size_t findNearest(const Vector3f &origin, const ItemTypeSet &types, size_t count, timestamp_t since,
+                       float radius, std::vector<GridItem> *items) const;
+    
+    /**
+     * Returns all items last seen before some time that are not
+     * persistent.
+     *
+     * @param before Expiry time
+     * @param items Output vector for expired items
+     */
+    void findExpired(timestamp_t before, std::vector<GridItem> *items) const;
+    
+    /**
+     * Returns all items of some type.
+     *
+     * @param type Item type
+     * @param since Items last seen before this time are skipped unless
+     *              they are persistent
+     * @param items Output vector for found items
+     */
+    void findAll(Item::Type type, timestamp_t since, std::vector<GridItem> *items) const;
+private:
+    // Item entries by slot, free slots have no node
+    std::vector<GridItem> m_entries;
+    std::vector<int> m_free;
+    boost::unordered_map<Item, int> m_slots;
+    
+    // Number of registered items of each type
+    std::vector<size_t> m_typeCounts;
+    
+    // Spatial tree and the number of removals since it was balanced
+    GridTree m_tree;
+    size_t m_erased;
+    
+    // Bounding box of all items registered since the index was cleared
+    Vector3f m_mins;
+    Vector3f m_maxs;
+};
 
 /**
  * A path through the grid.
  */
 class GridPath {
+friend class Grid;
 public:
     /**
      * Class constructor.
@@ -348,8 +629,10 @@ private:
     int m_currentNode;
     std::vector<GridNode*> m_path;
     GridTree m_pathTree;
-    GridWaypointIndexMap m_waypointMap;
     bool m_destinationReached;
+    
+    // Incremental search state kept between path repairs
+    boost::shared_ptr<GridRepairState> m_repair;
 };
 
 /**
@@ -398,8 +681,146 @@ public:
     virtual void close() = 0;
 };
 
-// Waypoint map
-typedef boost::unordered_map<GridWaypoint, GridNode*> GridWaypointNodeMap;
+/**
+ * Landmark distances used by the ALT path finding heuristic. Distances
+ * from landmark l to node i and from node i to landmark l are held at
+ * index i * count + l of the distance tables.
+ */
+struct GridLandmarks {
+    // Number of landmarks and their node indices
+    int count;
+    std::vector<int> nodes;
+    
+    // Number of nodes covered by the distance tables
+    int size;
+    
+    // Distance tables, unreachable nodes have infinite distance
+    std::vector<float> from;
+    std::vector<float> to;
+};
+
+/**
+ * Path lengths and next hops from every node towards the nearest item
+ * of some type.
+ */
+struct GridFlowField {
+    // Structure version of the graph view and version of item
+    // registrations this field was computed for
+    unsigned int structure;
+    unsigned int version;
+    
+    // Sorted indices of nodes holding an item
+    std::vector<int> sources;
+    
+    // Next node towards the nearest item (-1 at item nodes and where no
+    // item can be reached) and path length to that item
+    std::vector<int> nextHops;
+    std::vector<float> distances;
+};
+
+/**
+ * Last visit times of grid nodes. Times are atomic, so they are updated
+ * in place while graph views are reading them.
+ */
+class GridVisitTimes {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param size Number of nodes
+     * @param previous Optional smaller array to copy visit times from
+     */
+    GridVisitTimes(size_t size, const GridVisitTimes *previous = NULL);
+    
+    /**
+     * Returns the number of nodes.
+     */
+    inline size_t size() const { return m_size; }
+    
+    /**
+     * Returns the last visit time of a node.
+     */
+    inline timestamp_t get(int node) const { return m_times[node].load(boost::memory_order_relaxed); }
+    
+    /**
+     * Sets the last visit time of a node.
+     */
+    inline void set(int node, timestamp_t time) { m_times[node].store(time, boost::memory_order_relaxed); }
+private:
+    size_t m_size;
+    boost::scoped_array<boost::atomic<timestamp_t> > m_times;
+};
+
+/**
+ * A compact view of the grid graph that is used for searching. Nodes
+ * are identified by their index and links going out of node i are held
+ * between offsets[i] and offsets[i + 1] in the link arrays. Views are
+ * immutable once published, so readers use them without locking the
+ * grid while new views are built as the grid is learned.
+ */
+struct GridGraph {
+    // Node attributes
+    std::vector<GridNode*> nodes;
+    std::vector<Vector3f> locations;
+    std::vector<unsigned char> media;
+    std::vector<unsigned char> types;
+    std::vector<bool> linked;
+    
+    // Last visit times; these are shared with the grid and updated in
+    // place, as they change far too often to be copied into every view
+    boost::shared_ptr<const GridVisitTimes> lastVisits;
+    
+    // Spatial index of node locations
+    boost::shared_ptr<const GridSpatialHash> cells;
+    
+    // Links in compressed sparse row form
+    std::vector<int> offsets;
+    std::vector<int> targets;
+    std::vector<float> ranks;
+    
+    // Reversed links (without ranks) in compressed sparse row form
+    std::vector<int> reverseOffsets;
+    std::vector<int> reverseTargets;
+    
+    // Structure version; changes whenever nodes, links or media change
+    unsigned int structure;
+    
+    // Time when this view was built
+    timestamp_t built;
+    
+    // Landmark distances for the path finding heuristic, missing while
+    // links have changed since they were last computed, and the time when
+    // they were last computed
+    boost::shared_ptr<const GridLandmarks> landmarks;
+    timestamp_t landmarksBuilt;
+    
+    /**
+     * Returns the number of nodes in the graph.
+     */
+    inline int size() const { return locations.size(); }
+    
+    /**
+     * Returns a lower bound on the path length between two nodes. This
+     * is the largest of the straight line distance and the triangle
+     * inequality bounds given by the landmarks. Nodes added after the
+     * landmarks were computed are only bounded by the straight line
+     * distance.
+     *
+     * @param node Node index
+     * @param goal Goal node index
+     */
+    float heuristic(int node, int goal) const;
+    
+    /**
+     * Returns the nearest node to some location.
+     *
+     * @param loc Location coordinates
+     * @param radius Search radius
+     * @param onlyLinked Should only linked nodes be considered
+     * @return Node index or -1 when there is no node in range
+     */
+    int findNearest(const Vector3f &loc, float radius, bool onlyLinked) const;
+};
 
 /**
  * Mapping grid.
@@ -413,6 +834,22 @@ public:
     // Item expiry time (in msec)
     enum { item_expiry_time = 60000 };
     
+    // Number of landmarks used by the path finding heuristic
+    enum { landmark_count = 8 };
+    
+    // Graph views with link or rank changes are rebuilt once this many
+    // nodes have changed or the published view is older than the interval
+    // (in msec); new nodes are always published right away
+    enum { graph_rebuild_changes = 64, graph_rebuild_interval = 1000 };
+    
+    // Landmarks dropped after links have changed are computed again at
+    // most once per this interval (in msec)
+    enum { landmark_refresh_interval = 2000 };
+    
+    // Rules used when generating the grid from map geometry; player origin
+    // height above the floor, highest step and longest generated link
+    enum { player_height = 24, step_height = 18, sample_spacing = 48 };
+    
     /**
      * Class constructor.
      *
@@ -431,14 +868,16 @@ public:
     void clear();
     
     /**
-     * Exports the grid.
+     * Exports the grid. The grid is locked while nodes and links are
+     * passed to the exporter but not when the exporter is closed.
      *
      * @param exporter Grid exporter
      */
     void exportGrid(GridExporter *exporter);
     
     /**
-     * Imports the grid from an external file in internal format.
+     * Imports the grid from an external file in internal text or
+     * binary format.
      *
      * @param filename Import filename
      */ 
@@ -473,7 +912,32 @@ public:
     void learnItem(GridNode *node);
     
     /**
-     * Returns the nearest node accoording to some location.
+     * Adds an item to a grid node and registers the node as an item
+     * node. The node is changed under the grid lock.
+     *
+     * @param node Node holding the item
+     * @param item Item to add
+     */
+    void learnItem(GridNode *node, const Item &item);
+    
+    /**
+     * Registers item and spawn point nodes for all entities that are
+     * placed in the map, so they are known before they are first seen.
+     * Placed items are persistent and are never collected as expired.
+     */
+    void learnEntities();
+    
+    /**
+     * Generates grid nodes and links from walkable map faces and the
+     * links between them, so maps can be played without first learning
+     * the grid from exploration.
+     */
+    void learnMap();
+    
+    /**
+     * Returns the nearest node accoording to some location. The lookup
+     * is made in the published graph view, so nodes learned since it
+     * was built are not considered.
      *
      * @param loc Location coordinates
      * @param radius Search radius
@@ -493,6 +957,36 @@ public:
      */
     bool findPath(const Vector3f &start, const Vector3f &end, GridPath *path, bool full = true);
     
+    /**
+     * Finds a path to the nearest item of some type by following the
+     * flow field of that item type. Item distance is measured along the
+     * grid graph.
+     *
+     * @param type Type of item
+     * @param start Start location coordinates
+     * @param path Where to save the path
+     * @param distance Optional location where path length is stored
+     * @return True when path was found, false otherwise
+     */
+    bool findItemPath(Item::Type type, const Vector3f &start, GridPath *path, float *distance = NULL);
+    
+    /**
+     * Repairs a path after the bot has been displaced from it or got
+     * stuck on the link towards the current path node. Search state is
+     * created when the path is planned and kept with it between repairs
+     * (D* Lite), so only the part of the graph that is affected by the
+     * change is searched again. The last published graph view is used;
+     * when its structure has changed since the path was planned, the
+     * path can't be repaired and must be planned again.
+     *
+     * @param start Current location coordinates
+     * @param path Path to repair, its destination is kept
+     * @param blocked Should the link towards the current path node be
+     *                avoided from now on
+     * @return True when path was found, false otherwise
+     */
+    bool repairPath(const Vector3f &start, GridPath *path, bool blocked);
+    
     /**
      * Returns a random path from origin.
      *
@@ -514,7 +1008,8 @@ public:
     GridNode *getNodeByLocation(const Vector3f &loc, bool create = true);
     
     /**
-     * Returns the closest node of the specified medium.
+     * Returns the closest node of the specified medium. The lookup is
+     * made in the published graph view.
      *
      * @param loc Location coordinates
      * @param medium Wanted medium
@@ -530,6 +1025,20 @@ public:
      * @param origin The agent's position
      */
     GridNode *getNearestItemNode(Item::Type type, const Vector3f &origin);
+    
+    /**
+     * Finds the nearest items of some types that have not expired,
+     * ordered by distance from the origin.
+     *
+     * @param origin The agent's position
+     * @param types Wanted item types
+     * @param count Maximum number of items
+     * @param items Output vector for found items
+     * @param radius Search radius
+     * @return Number of found items
+     */
+    size_t findNearestItems(const Vector3f &origin, const ItemTypeSet &types, size_t count, std::vector<GridItem> *items,
+                            float radius = std::numeric_limits<float>::infinity());
    
     /**
      * Performs grid node expiry tasks.
@@ -544,13 +1053,95 @@ protected:
     /**
      * Returns a node that is linked from start node.
      * 
-     * @param start Start GridNode
-     * @param visitedNodes Set of nodes that have been visited in this path construction
+     * @param graph Grid graph view
+     * @param start Start node index
+     * @param visitedNodes Nodes that have been visited in this path construction
      * @param randomize When true pick node at random, otherwise pick least recently visited node
-     * @return GridNode when successive node is found or NULL if successive node cannot be found 
+     * @return Node index when successive node is found or -1 if successive node cannot be found 
      *         (if there is no link from start node or if all nodes from start node have been visited already = cycle)
      */
-    GridNode* pickNextNode(GridNode *start, const std::set<GridNode*> &visitedNodes, bool randomize) const;
+    int pickNextNode(const GridGraph &graph, int start, const std::vector<bool> &visitedNodes, bool randomize) const;
+    
+    /**
+     * Learns a generated link between two player locations when a player
+     * can walk from one to another. Long links are split into shorter
+     * ones with ground beneath each sample, while links that drop more
+     * than a step are allowed to fall over gaps.
+     *
+     * @param locA Start location
+     * @param locB End location
+     * @return True when the link has been learned
+     */
+    bool learnWalkable(const Vector3f &locA, const Vector3f &locB);
+    
+    /**
+     * Imports the grid from a memory mapped file in binary format. Nodes,
+     * links and lookup structures are built in a single pass without
+     * going through the learning paths.
+     *
+     * @param filename Import filename
+     * @return True if the grid has been imported
+     */
+    bool importBinaryGrid(const std::string &filename);
+    
+    /**
+     * Creates a new grid node at some location and registers it with
+     * the lookup structures. The caller must hold the grid lock.
+     *
+     * @param location Node location
+     * @return New GridNode instance
+     */
+    GridNode *createNode(const Vector3f &location);
+    
+    /**
+     * Records that a node has changed since the graph view was built.
+     * The caller must hold the grid lock exclusively.
+     *
+     * @param node Node index
+     * @param structure True if links or medium have changed
+     */
+    void markChanged(int node, bool structure);
+    
+    /**
+     * Returns true if landmarks of a graph view are missing and may be
+     * computed again.
+     *
+     * @param graph Graph view
+     * @param now Current time
+     */
+    static bool needsLandmarks(const GridGraph &graph, timestamp_t now);
+    
+    /**
+     * Returns the published graph view, rebuilding it first when nodes
+     * have been created or enough links have been learned since it was
+     * last built; smaller link and rank changes are batched while the
+     * view is young. A view is also rebuilt when its landmarks were
+     * dropped and may be computed again. The grid is only locked while changed nodes are
+     * copied, the rest of the view is carried over from the previous one.
+     * When the previous view has all nodes and another thread is
+     * rebuilding it or a writer holds the lock, the previous view is
+     * returned instead of waiting. The caller must not hold the grid lock.
+     */
+    boost::shared_ptr<const GridGraph> getGraph();
+    
+    /**
+     * Returns the flow field towards items of some type, computing it
+     * first when items of that type have changed or the graph structure
+     * is different from the one it was computed for. When only items
+     * have changed, the previous field is repaired instead.
+     *
+     * @param type Type of item
+     * @param graph Current graph view
+     */
+    boost::shared_ptr<const GridFlowField> getFlowField(Item::Type type, const GridGraph &graph);
+    
+    /**
+     * Marks the flow field of some item type as outdated after items of
+     * that type appeared or expired.
+     *
+     * @param type Type of item
+     */
+    void invalidateFlowField(Item::Type type);
     
     /**
      * Returns the BSP map associated with this grid.
@@ -560,16 +1151,38 @@ private:
     // Static geometry map
     Map *m_map;
     
-    // Lookup data structures
-    GridTree m_tree;
-    GridWaypointNodeMap m_waypointMap;
-    GridWaypointNodeMap m_itemWaypointMap;
-    std::set<GridNode*> m_itemNodes;
-
-    boost::unordered_map<Item::Type, GridTree> m_items;
+    // Nodes by index and their last visit times; visit times are kept
+    // in an array that is replaced by a larger copy when it fills up
+    std::vector<GridNode*> m_nodes;
+    boost::shared_ptr<GridVisitTimes> m_lastVisits;
+    
+    // Published graph view, rebuilt on demand after learning, and nodes
+    // that have changed since then (guarded by the grid lock)
+    boost::shared_ptr<const GridGraph> m_graph;
+    boost::atomic<bool> m_graphDirty;
+    boost::atomic<bool> m_structureDirty;
+    boost::atomic<bool> m_nodesDirty;
+    boost::atomic<unsigned int> m_changeCount;
+    std::vector<int> m_changedNodes;
+    std::vector<bool> m_changedFlags;
+    boost::mutex m_publishMutex;
+    
+    // Flow fields towards items of each type and versions of item
+    // registrations they were computed for, guarded by graph mutex
+    boost::unordered_map<Item::Type, boost::shared_ptr<const GridFlowField> > m_flowFields;
+    boost::unordered_map<Item::Type, unsigned int> m_itemVersions;
+    boost::mutex m_graphMutex;
+    
+    // Path finding state borrowed by threads that search this grid
+    boost::shared_ptr<GridScratch> m_scratch;
+    
+    // Lookup data structures, waypoints carry node indices
+    GridSpatialHash m_cells;
+    GridItemIndex m_items;
     
-    // Random generator
+    // Random generator, shared by all threads that plan paths
     mutable boost::mt19937 m_gen;
+    mutable boost::mutex m_genMutex;
     
     // Mutex
     boost::shared_mutex m_mutex;
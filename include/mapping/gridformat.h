@@ -0,0 +1,76 @@
+/*
+ * This file is part of HiveMind distributed Quake 2 bot.
+ *
+ * Copyright (C) 2010 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2010 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ * Copyright (C) 2010 by Grega Kespret <grega.kespret@gmail.com>
+ */
+#ifndef HM_MAPPING_GRIDFORMAT_H
+#define HM_MAPPING_GRIDFORMAT_H
+
+#include <stdint.h>
+
+// Magic constants
+#define IDGRIDHEADER (('D'<<24)+('I'<<16)+('R'<<8)+'G')
+#define GRIDVERSION 1
+
+namespace HiveMind {
+
+namespace GridFormat {
+
+/**
+ * Grid file directory entry. Offsets and sizes are in bytes from the
+ * start of the file and every section is aligned to four bytes.
+ */
+typedef struct {
+  int32_t offset;
+  int32_t size;
+} grid_dir_entry_t;
+
+/**
+ * Grid file header.
+ */
+typedef struct {
+  int32_t ident;
+  int32_t version;
+  int32_t numnodes;
+  int32_t numwaypoints;
+  int32_t numlinks;
+  grid_dir_entry_t nodes;
+  grid_dir_entry_t waypoints;
+  grid_dir_entry_t linkoffsets;
+  grid_dir_entry_t links;
+  grid_dir_entry_t media;
+  grid_dir_entry_t types;
+} grid_header_t;
+
+/**
+ * Grid node; its index in the node array is its identifier.
+ */
+typedef struct {
+  float location[3];
+} grid_node_t;
+
+/**
+ * Grid waypoint, waypoints are stored sorted by node.
+ */
+typedef struct {
+  int32_t node;
+  float location[3];
+} grid_waypoint_t;
+
+/**
+ * Grid link; links of node i are stored at indices from linkoffsets[i]
+ * up to linkoffsets[i + 1].
+ */
+typedef struct {
+  int32_t target;
+  float rank;
+} grid_link_t;
+
+}
+
+}
+
+#endif
+
@@ -99,6 +99,24 @@ public:
      */
     inline timestamp_t getLastSeen() const { return m_lastSeen; }
     
+    /**
+     * Marks this item as persistent. Persistent items are placed by the
+     * map and respawn there, so they never expire.
+     */
+    inline void setPersistent(bool persistent) { m_persistent = persistent; }
+    
+    /**
+     * Returns true if this item is persistent.
+     */
+    inline bool isPersistent() const { return m_persistent; }
+    
+    /**
+     * Returns true if this item has expired.
+     *
+     * @param before Items last seen before this time have expired
+     */
+    inline bool isExpired(timestamp_t before) const { return !m_persistent && m_lastSeen < before; }
+    
     /**
      * Returns a new item of proper type.
      *
@@ -106,6 +124,21 @@ public:
      */
     static Item forModel(const std::string &model);
     
+    /**
+     * Returns true if entities of some class are collectable items.
+     *
+     * @param classname Entity class name
+     */
+    static bool isItemClass(const std::string &classname);
+    
+    /**
+     * Returns a new item of proper type for an entity placed in the
+     * map.
+     *
+     * @param classname Entity class name
+     */
+    static Item forClassName(const std::string &classname);
+    
     /**
      * Comparison operator.
      */
@@ -132,9 +165,16 @@ private:
     Vector3f m_location;
     bool m_weapon;
     timestamp_t m_lastSeen;
+    bool m_persistent;
     
     // Item map
     static boost::unordered_map<std::string, Type> m_modelMap;
+    static boost::unordered_map<std::string, Type> m_classMap;
+    
+    /**
+     * Initializes the entity class map when not yet available.
+     */
+    static void initClassMap();
 };
 
 }
@@ -11,6 +11,10 @@
 #include "object.h"
 #include "timing.h"
 
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+
 #include <list>
 #include <vector>
 
@@ -18,7 +22,9 @@ namespace HiveMind {
 
 class Context;
 class MapPrivate;
+class MapScratch;
 class MapLink;
+struct MapLinkCandidate;
 
 // A list of map links
 typedef std::list<MapLink*> LinkList;
@@ -86,18 +92,51 @@ private:
     int m_index;
     long m_type;
     Vector3f m_origin;
-    LinkList m_links; 
+    LinkList m_links; 
 };
 
 /**
- * Map link.
+ * Map link. Links are shared between all bots playing the same map, so
+ * they only describe the link graph; per-bot link properties are held by
+ * MapLinkState.
  */
 class MapLink {
 public:
     /**
      * Class constructor.
      */
-    MapLink(MapFace *face, const Vector3f &origin);
+    MapLink(int index, MapFace *face, const Vector3f &origin);
+    
+    /**
+     * Returns link's index.
+     */
+    inline int getIndex() const { return m_index; }
+    
+    /**
+     * Returns destination face.
+     */
+    inline MapFace *getFace() const { return m_face; }
+    
+    /**
+     * Returns link origin coordinates. These are interpolated between the
+     * two faces.
+     */
+    inline Vector3f getOrigin() const { return m_origin; }
+private:
+    int m_index;
+    MapFace *m_face;
+    Vector3f m_origin;
+};
+
+/**
+ * Properties of a map link that are private to a single bot.
+ */
+class MapLinkState {
+public:
+    /**
+     * Class constructor.
+     */
+    MapLinkState();
     
     /**
      * Updates last visited timestamp to current time.
@@ -127,29 +166,16 @@ public:
      */
     inline bool isValid() const { return m_valid; }
     
-    /**
-     * Returns destination face.
-     */
-    inline MapFace *getFace() const { return m_face; }
-    
-    /**
-     * Returns link origin coordinates. These are interpolated between the
-     * two faces.
-     */
-    inline Vector3f getOrigin() const { return m_origin; }
-    
     /**
      * Invalidates this link.
      */
     inline void invalidate() { m_valid = false; }
-private:
-    MapFace *m_face;
-    bool m_valid;
-    Vector3f m_origin;
-
+private:
+    bool m_valid;
+    
     // Link properties
     timestamp_t m_lastVisited;
-    float m_cost;
+    float m_cost;
 };
 
 /**
@@ -165,7 +191,20 @@ struct MapPath {
 };
 
 /**
- * A complete Quake 2 BSP map implementation.
+ * An entity placed in the map by its author.
+ */
+struct MapEntity {
+    // Entity class (for example item_health or info_player_deathmatch)
+    std::string classname;
+    
+    // Entity location
+    Vector3f origin;
+};
+
+/**
+ * A complete Quake 2 BSP map implementation. Map geometry and the link
+ * graph are immutable once opened and are shared by all Map instances
+ * in the process that open the same map.
  */
 class Map : public Object {
 public:
@@ -182,6 +221,18 @@ public:
       Mist = 64
     };
     
+    /**
+     * Ray cache statistics.
+     */
+    struct RayCacheStats {
+      // Number of cache hits and misses since the cache was configured
+      unsigned long hits;
+      unsigned long misses;
+      
+      // Number of cached results
+      size_t size;
+    };
+    
     /**
      * Class constructor.
      *
@@ -196,7 +247,8 @@ public:
     virtual ~Map();
     
     /**
-     * Opens the map, loading and linking it.
+     * Opens the map, loading and linking it unless it has already been
+     * opened by another instance in this process.
      */
     bool open();
     
@@ -220,9 +272,72 @@ public:
      * @param start Start vector
      * @param end End vector
      * @param mask Brush contents mask
+     * @param cached Allow reuse of an earlier result for a nearby ray
      * @return Fraction of distance where the hit ocurred
      */
-    float rayTest(const Vector3f &start, const Vector3f &end, int mask);
+    float rayTest(const Vector3f &start, const Vector3f &end, int mask, bool cached = false);
+    
+    /**
+     * Casts a batch of rays and checks each of them for intersections
+     * in the same way as rayTest. Rays are traced through the BSP tree
+     * in packets, so rays that start close together share node visits.
+     *
+     * @param start Array of start vectors
+     * @param end Array of end vectors
+     * @param count Number of rays in the batch
+     * @param mask Brush contents mask
+     * @param fractions Where to store hit fractions (one for each ray)
+     * @param cached Allow reuse of earlier results for nearby rays
+     */
+    void rayTestBatch(const Vector3f *start, const Vector3f *end, int count, int mask, float *fractions,
+                      bool cached = false);
+    
+    /**
+     * Sweeps an axis-aligned box from start vector to end vector and
+     * checks if it collides with any brushes on the way. This is the
+     * same kind of trace the game uses for moving players, so thin
+     * geometry that a ray would pass through is also detected. Passing
+     * zero mins and maxs results in a point trace against brushes.
+     *
+     * @param start Start vector
+     * @param end End vector
+     * @param mins Box minimum corner relative to the traced point
+     * @param maxs Box maximum corner relative to the traced point
+     * @param mask Brush contents mask
+     * @param cached Allow reuse of an earlier result for a nearby trace
+     * @return Fraction of distance where the box hit a brush
+     */
+    float traceBox(const Vector3f &start, const Vector3f &end, const Vector3f &mins, const Vector3f &maxs, int mask,
+                   bool cached = false);
+    
+    /**
+     * Configures the ray cache. Cached traces have their start and end
+     * coordinates quantized, so a trace whose endpoints fall into the
+     * same cells as a previous one reuses that result. The least recently
+     * used results are evicted when the cache is full. Reconfiguring the
+     * cache clears it and resets its statistics.
+     *
+     * @param capacity Maximum number of cached results (zero disables the cache)
+     * @param quantum Quantization cell size in world units
+     */
+    void setRayCache(size_t capacity, float quantum);
+    
+    /**
+     * Returns ray cache hit and miss counters.
+     */
+    RayCacheStats getRayCacheStats() const;
+
+    /**
+     * Checks whether one point can possibly see another according to the
+     * potentially visible sets of their BSP clusters. This is a cheap and
+     * conservative test, so a positive result must still be confirmed by
+     * a ray test.
+     *
+     * @param from Viewer position
+     * @param to Target position
+     * @return False when the target is certainly not visible
+     */
+    bool isPotentiallyVisible(const Vector3f &from, const Vector3f &to) const;
     
     /**
      * Returns brush contents at a specific point.
@@ -232,6 +347,26 @@ public:
      */
     int pointContents(const Vector3f &point);
     
+    /**
+     * Returns brush contents at a specific point. When the map has a
+     * contents grid and the 16 unit cell containing the point has the
+     * same contents throughout, this is a table lookup; otherwise the
+     * BSP tree is used.
+     *
+     * @param point Point to be considered
+     * @return Brush contents mask
+     */
+    int cellContents(const Vector3f &point);
+    
+    /**
+     * Returns true when there is solid ground up to 50 units below the
+     * specified point. Uses the contents grid when it can decide, otherwise
+     * a ray is cast.
+     *
+     * @param point Point to be considered
+     */
+    bool isGroundBelow(const Vector3f &point);
+    
     /**
      * Returns the specified link object.
      *
@@ -239,7 +374,42 @@ public:
      * @return Associated MapLink instance or NULL when id is invalid
      */
     MapLink *getLink(int linkId) const;
+    
+    /**
+     * Returns this instance's state of the specified link.
+     *
+     * @param link Link instance
+     * @return Link state or NULL when link is invalid
+     */
+    MapLinkState *getLinkState(const MapLink *link);
+    
+    /**
+     * Returns the number of faces in the path finding graph.
+     */
+    int getFaceCount() const;
+    
+    /**
+     * Returns the specified face object.
+     *
+     * @param faceId Face identifier
+     * @return Associated MapFace instance or NULL when id is invalid
+     */
+    MapFace *getFace(int faceId) const;
+    
+    /**
+     * Returns all entities that have an origin and are placed in the
+     * map's entities lump.
+     */
+    const std::vector<MapEntity> &getEntities() const;
 protected:
+    /**
+     * Loads, links and indexes the map data that is shared between
+     * instances.
+     *
+     * @return True if the map was opened successfully
+     */
+    bool openShared();
+    
     /**
      * Loads the map.
      *
@@ -291,7 +461,28 @@ protected:
     /**
      * Helper method for linking.
      */
-    bool checkWall(int wall, int face, int edge);
+    bool checkWall(int wall, int face, int edge, std::vector<MapLinkCandidate> *links);
+    
+    /**
+     * Discovers links going out of a walkable face.
+     *
+     * @param face Face identifier
+     * @param links Where to store discovered links
+     * @return True if linking was successful
+     */
+    bool linkFace(int face, std::vector<MapLinkCandidate> *links);
+    
+    /**
+     * Discovers links for a share of faces; used by link threads.
+     *
+     * @param faces Faces to be linked
+     * @param thread Index of this thread
+     * @param threads Number of link threads
+     * @param candidates Where to store discovered links of each face
+     * @param result Where to store false when linking fails
+     */
+    void linkWorker(const std::vector<int> *faces, int thread, int threads,
+                    std::vector<std::vector<MapLinkCandidate> > *candidates, char *result);
     
     /**
      * Finds the leaf the specified position belongs to.
@@ -301,6 +492,65 @@ protected:
      */
     int findLeafId(const Vector3f &pos) const;
     
+    /**
+     * Builds compact walkable face outlines for each leaf, so faces can
+     * be looked up without walking the edge lumps.
+     */
+    void buildFacePolygons();
+    
+    /**
+     * Decompresses potentially visible sets of all clusters.
+     *
+     * @return True if visibility data is valid
+     */
+    bool loadVisibility();
+    
+    /**
+     * Parses the entities lump, keeping the class and origin of each
+     * entity that has both.
+     *
+     * @return True if the entities lump is valid
+     */
+    bool loadEntities();
+    
+    /**
+     * Builds a sparse grid of cell contents and ground flags that is used
+     * for fast approximate contents queries. Maps that would need too
+     * many cells do not get a grid.
+     */
+    void buildContentsGrid();
+    
+    /**
+     * Assigns faces to BSP areas and builds the area graph that is used
+     * for hierarchical path finding.
+     */
+    void buildAreaGraph();
+    
+    /**
+     * Finds a route through the area graph between the areas of two
+     * faces.
+     *
+     * @param startFaceId Start face identifier
+     * @param endFaceId End face identifier
+     * @param corridor Where to mark areas that are on the route
+     * @return True when the faces are in different, connected areas
+     */
+    bool findAreaRoute(int startFaceId, int endFaceId, std::vector<bool> *corridor) const;
+    
+    /**
+     * Performs an A* search through the face graph.
+     *
+     * @param end Destination coordinates
+     * @param startFaceId Start face identifier
+     * @param endFaceId End face identifier
+     * @param corridor Optional set of areas the search is limited to
+     * @param path Where to save the path
+     * @param full Should a full path be returned or not
+     * @return True when the path was found
+     */
+    bool searchPath(const Vector3f &end, int startFaceId, int endFaceId, const std::vector<bool> *corridor,
+                    MapPath *path, bool full) const;
+    
     /**
      * Finds the face the specified position belongs to.
      *
@@ -329,7 +579,83 @@ protected:
      */
     float intersectTree(const Vector3f &start, const Vector3f &end, int node, float min, float max, int mask) const;
     
-    MapLink *createLink(int face, int n, int k);
+    /**
+     * Performs intersection of a packet of up to four rays with the BSP
+     * tree using an explicit traversal stack.
+     *
+     * @param start Array of start vectors
+     * @param end Array of end vectors
+     * @param count Number of rays in the packet
+     * @param mask Contents mask
+     * @param fractions Where to store fractional intersection distances
+     */
+    void intersectTreePacket(const Vector3f *start, const Vector3f *end, int count, int mask, float *fractions) const;
+    
+    /**
+     * Helper method for linking; records a link to the face on the
+     * given side of edge n, placed in the middle of edge k.
+     */
+    void createLink(int face, int n, int k, std::vector<MapLinkCandidate> *links);
+    
+    /**
+     * Computes a hash of all BSP lumps that are used for linking. This
+     * is used to detect stale link caches.
+     */
+    uint64_t computeHash() const;
+    
+    /**
+     * Returns the filename of the link cache for this map.
+     */
+    std::string getLinkCacheFilename() const;
+    
+    /**
+     * Loads a previously computed link graph from cache.
+     *
+     * @param filename Cache filename
+     * @param hash Hash of the currently loaded map
+     * @return True if the cache was valid and has been loaded
+     */
+    bool loadLinkCache(const std::string &filename, uint64_t hash);
+    
+    /**
+     * Saves the computed link graph to cache.
+     *
+     * @param filename Cache filename
+     * @param hash Hash of the currently loaded map
+     * @return True if the cache has been saved
+     */
+    bool saveLinkCache(const std::string &filename, uint64_t hash) const;
+    
+    /**
+     * Extends the link cache hash with the BSP lumps that are used for
+     * contents queries. This is used to detect stale contents caches.
+     *
+     * @param hash Hash computed by computeHash
+     */
+    uint64_t computeContentsHash(uint64_t hash) const;
+    
+    /**
+     * Returns the filename of the contents cache for this map.
+     */
+    std::string getContentsCacheFilename() const;
+    
+    /**
+     * Loads a previously built contents grid from cache.
+     *
+     * @param filename Cache filename
+     * @param hash Contents hash of the currently loaded map
+     * @return True if the cache was valid and has been loaded
+     */
+    bool loadContentsCache(const std::string &filename, uint64_t hash);
+    
+    /**
+     * Saves the built contents grid to cache.
+     *
+     * @param filename Cache filename
+     * @param hash Contents hash of the currently loaded map
+     * @return True if the cache has been saved
+     */
+    bool saveContentsCache(const std::string &filename, uint64_t hash) const;
 private:
     // Context
     Context *m_context;
@@ -341,8 +667,14 @@ private:
     bool m_loaded;
     std::string m_name;
     
-    // Map attributes
-    MapPrivate *d;
+    // Shared map attributes
+    boost::shared_ptr<MapPrivate> d;
+    
+    // Per-instance link state
+    std::vector<MapLinkState> m_linkStates;
+    
+    // Per-instance search and trace state
+    boost::shared_ptr<MapScratch> m_scratch;
 };
 
 }
@@ -0,0 +1,97 @@
+/*
+ * This file is part of HiveMind distributed Quake 2 bot.
+ *
+ * Copyright (C) 2010 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2010 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ * Copyright (C) 2010 by Grega Kespret <grega.kespret@gmail.com>
+ */
+#ifndef HM_MAPPING_SCRATCH_H
+#define HM_MAPPING_SCRATCH_H
+
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <vector>
+
+namespace HiveMind {
+
+/**
+ * A free list of reusable scratch objects. Objects are handed out to one
+ * caller at a time and deleted together with the pool.
+ */
+template <typename T>
+class ScratchPool {
+public:
+    ~ScratchPool()
+    {
+      BOOST_FOREACH(T *item, m_free) {
+        delete item;
+      }
+    }
+    
+    /**
+     * Takes an object from the pool or returns NULL when it is empty.
+     */
+    T *acquire()
+    {
+      boost::lock_guard<boost::mutex> g(m_mutex);
+      if (m_free.empty())
+        return NULL;
+      
+      T *item = m_free.back();
+      m_free.pop_back();
+      return item;
+    }
+    
+    /**
+     * Returns an object to the pool.
+     */
+    void release(T *item)
+    {
+      boost::lock_guard<boost::mutex> g(m_mutex);
+      m_free.push_back(item);
+    }
+private:
+    boost::mutex m_mutex;
+    std::vector<T*> m_free;
+};
+
+/**
+ * Borrows a scratch object from a pool for the lifetime of the lease,
+ * creating a new one when the pool is empty.
+ */
+template <typename T>
+class ScratchLease {
+public:
+    ScratchLease(ScratchPool<T> &pool)
+      : m_pool(pool),
+        m_item(pool.acquire()),
+        m_fresh(false)
+    {
+      if (!m_item) {
+        m_item = new T();
+        m_fresh = true;
+      }
+    }
+    
+    ~ScratchLease()
+    {
+      m_pool.release(m_item);
+    }
+    
+    /**
+     * Returns true when the object was created for this lease.
+     */
+    bool isFresh() const { return m_fresh; }
+    
+    T *operator->() const { return m_item; }
+    T *get() const { return m_item; }
+private:
+    ScratchPool<T> &m_pool;
+    T *m_item;
+    bool m_fresh;
+};
+
+}
+
+#endif
@@ -21,7 +21,7 @@ class Map;
 class DistanceSensor {
 public:
     // Parameters
-    enum { step_size = 18 };
+    enum { step_size = 18, hull_step = 32 };
     
     /**
      * Class constructor. This constructs an invalid sensor.
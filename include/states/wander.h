@@ -89,6 +89,16 @@ protected:
      * @param randomize True means to pick the next node at random
      */
     void recomputePath(bool randomize = false);
+    
+    /**
+     * Repairs the current path from current location without waiting
+     * for the planner and falls back to path recomputation when the
+     * destination is no longer reachable.
+     *
+     * @param blocked True if the link being followed should not be used
+     * @param randomize True means to pick the next node at random on fallback
+     */
+    void repairPath(bool blocked, bool randomize = false);
 
     // Have we reached the destination?
     bool m_atDestination;
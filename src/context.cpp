@@ -11,6 +11,7 @@
 #include "mapping/map.h"
 #include "mapping/grid.h"
 #include "mapping/exporters.h"
+#include "mapping/checkpoint.h"
 #include "mapping/dynamic.h"
 #include "planner/local.h"
 #include "planner/global.h"
@@ -37,6 +38,8 @@
 #include "mold/server.h"
 #include "mold/client.h"
 
+#include <boost/filesystem.hpp>
+
 namespace HiveMind {
 
 Context::Context(const std::string &id, const std::string &gamedir, const std::string &datadir, 
@@ -46,6 +49,7 @@ Context::Context(const std::string &id, const std::string &gamedir, const std::s
     m_datadir(datadir),
     m_connection(NULL),
     m_map(NULL),
+    m_gridCheckpointer(NULL),
     m_abort(false),
     m_dispatcher(new Dispatcher(this)),
     m_simulatorInitialized(false),
@@ -65,6 +69,7 @@ Context::Context(const std::string &id, const std::string &gamedir, const std::s
 
 Context::~Context()
 {
+  delete m_gridCheckpointer;
   delete m_connection;
   delete m_map;
 }
@@ -81,7 +86,13 @@ void Context::simulationStart(const std::string &map)
   m_grid = new Grid(m_map);
   std::string mn = std::string(basename(map.c_str()));
   mn = mn.substr(0, mn.find("."));
-  m_grid->importGrid(getDataDir() + "/grid-" + mn + ".hm");
+  // Prefer the binary grid as it is loaded in a single pass
+  std::string gridFilename = getDataDir() + "/grid-" + mn;
+  if (boost::filesystem::exists(gridFilename + ".hmb"))
+    m_grid->importGrid(gridFilename + ".hmb");
+  else
+    m_grid->importGrid(gridFilename + ".hm");
+  m_grid->learnEntities();
   
   // Create the dynamic mapper
   m_dynamicMapper = new DynamicMapper(this);
@@ -142,7 +153,16 @@ void Context::connectTo(const std::string &host, unsigned int port)
   m_grid = new Grid(m_map);
   std::string mn = std::string(basename(m_connection->getMapName().c_str()));
   mn = mn.substr(0, mn.find("."));
-  m_grid->importGrid(getDataDir() + "/grid-" + mn + ".hm");
+  // Prefer the binary grid as it is loaded in a single pass
+  std::string gridFilename = getDataDir() + "/grid-" + mn;
+  if (boost::filesystem::exists(gridFilename + ".hmb"))
+    m_grid->importGrid(gridFilename + ".hmb");
+  else
+    m_grid->importGrid(gridFilename + ".hm");
+  m_grid->learnEntities();
+  
+  // What is learned about the map is saved into the binary grid
+  m_gridCheckpointer = new GridCheckpointer(m_grid, gridFilename + ".hmb");
   
   // Enter the game
   m_connection->begin();
@@ -181,6 +201,9 @@ void Context::execute()
   m_globalPlanner->registerVoter("System.WhoWillDrop", new DroperVoter(this));
   m_globalPlanner->start();
   
+  // Start saving the grid in the background
+  m_gridCheckpointer->start();
+  
   while (!m_abort) {
     // Process frame update from Quake II server, update planner
     GameState state = m_connection->getGameState();
@@ -203,6 +226,9 @@ void Context::execute()
   
   getLogger()->warning("Processing loop aborted.");
   
+  // Save what has been learned since the last checkpoint
+  m_gridCheckpointer->stop();
+  
   // Reset abort flag
   m_abort = false;
 }
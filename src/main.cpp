@@ -8,6 +8,7 @@
 #include "context.h"
 
 #include <ctime>
+#include <signal.h>
 
 #include <boost/program_options.hpp>
 #include <boost/random.hpp>
@@ -16,6 +17,20 @@
 using namespace HiveMind;
 namespace po = boost::program_options;
 
+// Context to abort on termination
+static Context *abortContext = NULL;
+
+/**
+ * Termination signal handler. Aborts the processing loop so that learned
+ * data is saved before exit; a repeated signal terminates right away.
+ */
+static void handleTermination(int sig)
+{
+  signal(sig, SIG_DFL);
+  if (abortContext)
+    abortContext->abort();
+}
+
 /**
  * Hivemind entry point.
  */
@@ -78,6 +93,10 @@ int main(int argc, char **argv)
   } else if (vm.count("mold-client")) {
     context.runMOLDClient(vm["mold-client"].as<std::string>());
     context.connectTo(vm["quake2-server"].as<std::string>(), 27910);
+    
+    abortContext = &context;
+    signal(SIGINT, handleTermination);
+    signal(SIGTERM, handleTermination);
     context.execute();
   } else {
     std::cout << "ERROR: Please specify --mold-server or --mold-client!" << std::endl;
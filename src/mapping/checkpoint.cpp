@@ -0,0 +1,118 @@
+/*
+ * This file is part of HiveMind distributed Quake 2 bot.
+ *
+ * Copyright (C) 2010 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2010 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ * Copyright (C) 2010 by Grega Kespret <grega.kespret@gmail.com>
+ */
+#include "mapping/checkpoint.h"
+#include "mapping/grid.h"
+#include "mapping/exporters.h"
+#include "logger.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+namespace HiveMind {
+
+GridCheckpointer::GridCheckpointer(Grid *grid, const std::string &filename, int interval)
+  : m_grid(grid),
+    m_filename(filename),
+    m_interval(interval),
+    m_running(false),
+    m_lockFd(-1)
+{
+  Object::init();
+}
+
+GridCheckpointer::~GridCheckpointer()
+{
+  stop();
+  releaseOwnership();
+}
+
+void GridCheckpointer::start()
+{
+  if (m_running)
+    return;
+  
+  m_running = true;
+  m_workerThread = boost::thread(&GridCheckpointer::process, this);
+}
+
+void GridCheckpointer::stop()
+{
+  if (!m_running)
+    return;
+  
+  // Wake the worker from its sleep, a checkpoint that is being written is
+  // finished first, and save what has been learned since then
+  m_workerThread.interrupt();
+  m_workerThread.join();
+  m_running = false;
+  checkpoint();
+  releaseOwnership();
+}
+
+void GridCheckpointer::checkpoint()
+{
+  // Interruption only stops the worker between checkpoints, never while
+  // the grid is being exported or written
+  boost::this_thread::disable_interruption di;
+  boost::lock_guard<boost::mutex> g(m_checkpointMutex);
+  if (!acquireOwnership())
+    return;
+  
+  BinaryGridExporter exporter(m_filename);
+  m_grid->exportGrid(&exporter);
+  
+  if (!exporter.isWritten())
+    getLogger()->warning(format("Failed to write grid checkpoint to %s!") % m_filename);
+}
+
+bool GridCheckpointer::acquireOwnership()
+{
+  if (m_lockFd != -1)
+    return true;
+  
+  // The lock is released by the system when the bot dies
+  std::string lockFilename = m_filename + ".lock";
+  int fd = open(lockFilename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return false;
+  
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return false;
+  }
+  
+  m_lockFd = fd;
+  getLogger()->info(format("Saving grid checkpoints to %s.") % m_filename);
+  return true;
+}
+
+void GridCheckpointer::releaseOwnership()
+{
+  if (m_lockFd == -1)
+    return;
+  
+  flock(m_lockFd, LOCK_UN);
+  close(m_lockFd);
+  m_lockFd = -1;
+}
+
+void GridCheckpointer::process()
+{
+  try {
+    for (;;) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(m_interval));
+      checkpoint();
+    }
+  } catch (boost::thread_interrupted &e) {
+    // Checkpointing has been stopped
+  }
+}
+
+}
+
@@ -76,9 +76,7 @@ void DynamicMapper::processEntity(const Entity &entity)
         Item item = Item::forModel(model);
         item.setLocation(entity.origin);
         item.updateLastSeen();
-        node->setType(GridNode::Item);
-        node->addItem(item);        
-        m_grid->learnItem(node);
+        m_grid->learnItem(node, item);
 
         // Add an appropriate state to eligible list
         checkEligible(model);
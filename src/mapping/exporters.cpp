@@ -7,6 +7,13 @@
  */
 #include "mapping/exporters.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <vector>
+
 namespace HiveMind {
 
 InternalGridExporter::InternalGridExporter(const std::string &filename)
@@ -52,6 +59,148 @@ void InternalGridExporter::close()
   m_nodeIds.clear();
 }
 
+BinaryGridExporter::BinaryGridExporter(const std::string &filename)
+  : m_filename(filename),
+    m_written(false)
+{
+}
+
+void BinaryGridExporter::open(size_t nodes)
+{
+  m_nodes.reserve(nodes);
+  m_media.reserve(nodes);
+  m_types.reserve(nodes);
+}
+
+void BinaryGridExporter::exportWaypoint(GridNode *node, const GridWaypoint &wp)
+{
+  Vector3f p = wp.getLocation();
+  GridFormat::grid_waypoint_t waypoint = { m_nodeIds[node], { p[0], p[1], p[2] } };
+  m_waypoints.push_back(waypoint);
+}
+
+void BinaryGridExporter::exportNode(GridNode *node)
+{
+  Vector3f p = node->getLocation();
+  GridFormat::grid_node_t gridNode = { { p[0], p[1], p[2] } };
+  m_nodeIds[node] = m_nodes.size();
+  m_nodes.push_back(gridNode);
+  m_media.push_back(node->getMedium());
+  m_types.push_back(node->getType());
+}
+
+void BinaryGridExporter::startLinks()
+{
+}
+
+void BinaryGridExporter::exportLink(GridNode *node, GridLink *link)
+{
+  GridFormat::grid_link_t gridLink = { m_nodeIds[link->getNode()], link->getRank() };
+  m_linkSources.push_back(m_nodeIds[node]);
+  m_links.push_back(gridLink);
+}
+
+/**
+ * Places a section of the given size at the specified offset and
+ * returns the offset of the next section.
+ */
+static int32_t layoutSection(GridFormat::grid_dir_entry_t &entry, int32_t offset, size_t size)
+{
+  entry.offset = offset;
+  entry.size = size;
+  return (offset + size + 3) & ~3;
+}
+
+/**
+ * Writes out a section padded to four bytes.
+ */
+static void writeSection(std::ofstream &out, const GridFormat::grid_dir_entry_t &entry, const void *data)
+{
+  static const char padding[4] = { 0, 0, 0, 0 };
+  out.seekp(entry.offset);
+  out.write(static_cast<const char*>(data), entry.size);
+  out.write(padding, ((entry.size + 3) & ~3) - entry.size);
+}
+
+void BinaryGridExporter::close()
+{
+  using namespace GridFormat;
+  
+  // Group links by source node
+  int nodeCount = m_nodes.size();
+  std::vector<int32_t> linkOffsets(nodeCount + 1, 0);
+  for (size_t i = 0; i < m_links.size(); i++) {
+    linkOffsets[m_linkSources[i] + 1]++;
+  }
+  for (int i = 0; i < nodeCount; i++) {
+    linkOffsets[i + 1] += linkOffsets[i];
+  }
+  
+  std::vector<grid_link_t> links(m_links.size());
+  std::vector<int32_t> fill(linkOffsets.begin(), linkOffsets.end() - 1);
+  for (size_t i = 0; i < m_links.size(); i++) {
+    links[fill[m_linkSources[i]]++] = m_links[i];
+  }
+  
+  grid_header_t header;
+  header.ident = IDGRIDHEADER;
+  header.version = GRIDVERSION;
+  header.numnodes = nodeCount;
+  header.numwaypoints = m_waypoints.size();
+  header.numlinks = links.size();
+  
+  int32_t offset = (sizeof(grid_header_t) + 3) & ~3;
+  offset = layoutSection(header.nodes, offset, m_nodes.size() * sizeof(grid_node_t));
+  offset = layoutSection(header.waypoints, offset, m_waypoints.size() * sizeof(grid_waypoint_t));
+  offset = layoutSection(header.linkoffsets, offset, linkOffsets.size() * sizeof(int32_t));
+  offset = layoutSection(header.links, offset, links.size() * sizeof(grid_link_t));
+  offset = layoutSection(header.media, offset, m_media.size());
+  offset = layoutSection(header.types, offset, m_types.size());
+  
+  // Temporary file is uniquely named as several bots may share the same
+  // data directory
+  std::vector<char> tempName(m_filename.begin(), m_filename.end());
+  const char suffix[] = ".XXXXXX";
+  tempName.insert(tempName.end(), suffix, suffix + sizeof(suffix));
+  int fd = mkstemp(&tempName[0]);
+  if (fd == -1) {
+    clear();
+    return;
+  }
+  
+  // Temporary files are private by default, the grid is not
+  fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  ::close(fd);
+  std::string tempFilename(&tempName[0]);
+  std::ofstream out(tempFilename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  writeSection(out, header.nodes, m_nodes.empty() ? NULL : &m_nodes[0]);
+  writeSection(out, header.waypoints, m_waypoints.empty() ? NULL : &m_waypoints[0]);
+  writeSection(out, header.linkoffsets, &linkOffsets[0]);
+  writeSection(out, header.links, links.empty() ? NULL : &links[0]);
+  writeSection(out, header.media, m_media.empty() ? NULL : &m_media[0]);
+  writeSection(out, header.types, m_types.empty() ? NULL : &m_types[0]);
+  out.close();
+  
+  if (!out.fail() && rename(tempFilename.c_str(), m_filename.c_str()) == 0)
+    m_written = true;
+  else
+    unlink(tempFilename.c_str());
+  
+  clear();
+}
+
+void BinaryGridExporter::clear()
+{
+  m_nodes.clear();
+  m_waypoints.clear();
+  m_linkSources.clear();
+  m_links.clear();
+  m_media.clear();
+  m_types.clear();
+  m_nodeIds.clear();
+}
+
 PajekGridExporter::PajekGridExporter(const std::string &filename)
   : m_out((filename + ".net").c_str()),
     m_outC((filename + ".vec").c_str())
@@ -8,10 +8,18 @@
 #include "mapping/grid.h"
 #include "mapping/map.h"
 #include "mapping/items.h"
+#include "mapping/gridformat.h"
+#include "mapping/scratch.h"
 #include "logger.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <ctime>
 #include <queue>
 #include <fstream>
+#include <algorithm>
+#include <limits>
 
 #include <boost/foreach.hpp>
 #include <boost/random/uniform_int.hpp>
@@ -19,16 +27,17 @@
 
 namespace HiveMind {
 
-GridWaypoint::GridWaypoint(const Vector3f &location)
-  : m_location(location)
+GridWaypoint::GridWaypoint(const Vector3f &location, int index)
+  : m_location(location),
+    m_index(index)
 {
 }
 
-GridNode::GridNode(Grid *grid)
+GridNode::GridNode(Grid *grid, int id)
   : m_grid(grid),
+    m_id(id),
     m_medium(Unknown),
     m_type(Normal),
-    m_lastVisit(0),
     m_linked(false)
 {
 }
@@ -66,7 +75,10 @@ void GridNode::addLink(GridNode *other, float weight, bool reinforce)
       
       if (visited.find(n) == visited.end()) {
         visited.insert(n);
-        n->m_linked = true;
+        if (!n->m_linked) {
+          n->m_linked = true;
+          m_grid->markChanged(n->m_id, false);
+        }
         
         typedef std::pair<GridNode*, GridLink*> NodeLinkPair;
         BOOST_FOREACH(NodeLinkPair p, n->links()) {
@@ -81,12 +93,52 @@ void GridNode::addLink(GridNode *other, float weight, bool reinforce)
   // Check if a link already exists so we don't duplicate it
   if (m_links.find(other) == m_links.end()) {
     m_links[other] = new GridLink(other, weight);
+    m_grid->markChanged(m_id, true);
   } else if (reinforce) {
     GridLink *link = m_links[other];
     link->reinforce(weight);
+    m_grid->markChanged(m_id, false);
+  }
+}
+
+void GridNode::setMedium(Medium medium)
+{
+  // Medium decides which links can be used and so affects distances
+  boost::unique_lock<boost::shared_mutex> g(m_grid->m_mutex);
+  m_medium = medium;
+  m_grid->markChanged(m_id, true);
+}
+
+void GridNode::setType(Type type)
+{
+  boost::unique_lock<boost::shared_mutex> g(m_grid->m_mutex);
+  m_type = type;
+  m_grid->markChanged(m_id, false);
+}
+
+void GridNode::setLinked()
+{
+  boost::unique_lock<boost::shared_mutex> g(m_grid->m_mutex);
+  if (!m_linked) {
+    m_linked = true;
+    m_grid->markChanged(m_id, false);
   }
 }
 
+timestamp_t GridNode::getLastVisit() const
+{
+  boost::shared_lock<boost::shared_mutex> g(m_grid->m_mutex);
+  return m_grid->m_lastVisits->get(m_id);
+}
+
+void GridNode::updateLastVisit()
+{
+  // Visit times are atomic, the lock only keeps the array from being
+  // replaced meanwhile
+  boost::shared_lock<boost::shared_mutex> g(m_grid->m_mutex);
+  m_grid->m_lastVisits->set(m_id, Timing::getCurrentTimestamp());
+}
+
 void GridNode::addItem(const HiveMind::Item &item)
 {
   // This is needed to update item's last updated time as this is not
@@ -102,16 +154,15 @@ void GridNode::removeItem(const HiveMind::Item &item)
 
 void GridNode::evaluateMedium()
 {
+  Map *map = m_grid->getMap();
   Medium medium;
-  Vector3f p = getLocation() - Vector3f(0, 0, 50);
-  float d = m_grid->getMap()->rayTest(getLocation(), p, Map::Solid);
-  if (d == 1.0) {
-    medium = Air;
-  } else {
+  if (map->isGroundBelow(getLocation())) {
     medium = Ground;
+  } else {
+    medium = Air;
   }
   
-  int contents = m_grid->getMap()->pointContents(getLocation() + Vector3f(0, 0, 20.0));
+  int contents = map->cellContents(getLocation() + Vector3f(0, 0, 20.0));
   if (contents & Map::Water) {
     medium = Water;
   }
@@ -125,6 +176,375 @@ GridLink::GridLink(GridNode *node, float weight)
 {
 }
 
+/**
+ * Reusable A* search state. Per-node data is held in arrays indexed by
+ * node index and is only valid for nodes stamped with the current search
+ * generation, so nothing needs to be cleared or allocated between
+ * searches. Open nodes are kept in an indexed binary heap that supports
+ * decreasing keys in place.
+ */
+class GridSearch {
+public:
+    // Per-node search states
+    enum { Unvisited = 0, Open, Closed };
+    
+    /**
+     * Prepares the search state for a new search over the given number
+     * of nodes.
+     */
+    void begin(size_t nodes)
+    {
+      if (generation.size() != nodes) {
+        generation.assign(nodes, 0);
+        costG.resize(nodes);
+        costF.resize(nodes);
+        parentNode.resize(nodes);
+        state.resize(nodes);
+        heapIndex.resize(nodes);
+        current = 0;
+      }
+      
+      if (++current == 0) {
+        // Generation counter wrapped around, stamps must be reset
+        std::fill(generation.begin(), generation.end(), 0);
+        current = 1;
+      }
+      
+      heap.clear();
+    }
+    
+    /**
+     * Returns the search state of a node.
+     */
+    inline int getState(int node) const
+    {
+      return generation[node] == current ? state[node] : Unvisited;
+    }
+    
+    /**
+     * Inserts a node into the open heap or moves it up when its cost
+     * has decreased.
+     */
+    void push(int node)
+    {
+      if (getState(node) != Open) {
+        generation[node] = current;
+        state[node] = Open;
+        heapIndex[node] = heap.size();
+        heap.push_back(node);
+      }
+      
+      siftUp(heapIndex[node]);
+    }
+    
+    /**
+     * Removes the node with the lowest cost estimate from the open heap
+     * and marks it as closed.
+     */
+    int pop()
+    {
+      int node = heap[0];
+      heap[0] = heap.back();
+      heapIndex[heap[0]] = 0;
+      heap.pop_back();
+      if (!heap.empty())
+        siftDown(0);
+      
+      state[node] = Closed;
+      return node;
+    }
+    
+    /**
+     * Returns true when there are no more open nodes.
+     */
+    inline bool empty() const { return heap.empty(); }
+    
+    // Per-node search data
+    std::vector<float> costG;
+    std::vector<float> costF;
+    std::vector<int> parentNode;
+    
+    // Scratch space for path reconstruction
+    std::vector<int> path;
+private:
+    void siftUp(int i)
+    {
+      int node = heap[i];
+      while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (costF[heap[parent]] <= costF[node])
+          break;
+        
+        heap[i] = heap[parent];
+        heapIndex[heap[i]] = i;
+        i = parent;
+      }
+      
+      heap[i] = node;
+      heapIndex[node] = i;
+    }
+    
+    void siftDown(int i)
+    {
+      int node = heap[i];
+      int size = heap.size();
+      for (;;) {
+        int child = 2*i + 1;
+        if (child >= size)
+          break;
+        if (child + 1 < size && costF[heap[child + 1]] < costF[heap[child]])
+          child++;
+        if (costF[node] <= costF[heap[child]])
+          break;
+        
+        heap[i] = heap[child];
+        heapIndex[heap[i]] = i;
+        i = child;
+      }
+      
+      heap[i] = node;
+      heapIndex[node] = i;
+    }
+    
+    std::vector<unsigned int> generation;
+    std::vector<unsigned char> state;
+    std::vector<int> heapIndex;
+    std::vector<int> heap;
+    unsigned int current;
+};
+
+/**
+ * Search state owned by a single Grid instance. Concurrent callers each
+ * borrow their own state, which is released when the instance is
+ * destroyed.
+ */
+class GridScratch {
+public:
+    ScratchPool<GridSearch> searches;
+};
+
+/**
+ * Incremental search state of a path that is repaired with D* Lite. The
+ * search runs backwards from the destination, so g holds path lengths
+ * to the destination and stays valid as the start moves. Open nodes are
+ * kept in an indexed binary heap ordered by two-part keys. Keys use the
+ * straight line distance, which stays consistent between any two nodes
+ * as the start moves. Values are kept in double precision since the key
+ * modifier keeps growing for as long as the path is being followed.
+ */
+class GridRepairState {
+public:
+    // Two-part D* Lite key
+    typedef std::pair<double, double> Key;
+    
+    /**
+     * Class constructor.
+     *
+     * @param graph Graph view to search
+     * @param goal Destination node index
+     * @param start Start node index
+     */
+    GridRepairState(const GridGraph &graph, int goal, int start)
+      : structure(graph.structure),
+        goal(goal),
+        last(start),
+        km(0),
+        g(graph.size(), std::numeric_limits<double>::infinity()),
+        rhs(graph.size(), std::numeric_limits<double>::infinity()),
+        heapIndex(graph.size(), -1),
+        keys(graph.size())
+    {
+      rhs[goal] = 0;
+      insert(goal, calculateKey(graph, start, goal));
+    }
+    
+    /**
+     * Returns the cost of a link that can be used by this path or
+     * infinity when it can't be used.
+     */
+    inline double cost(const GridGraph &graph, int from, int to) const
+    {
+      if (graph.media[from] == GridNode::Ground && graph.media[to] == GridNode::Air)
+        return std::numeric_limits<double>::infinity();
+      if (blocked.find(std::make_pair(from, to)) != blocked.end())
+        return std::numeric_limits<double>::infinity();
+      
+      return (graph.locations[from] - graph.locations[to]).norm();
+    }
+    
+    /**
+     * Computes the key of a node.
+     */
+    inline Key calculateKey(const GridGraph &graph, int start, int node) const
+    {
+      double m = std::min(g[node], rhs[node]);
+      return Key(m + (graph.locations[start] - graph.locations[node]).norm() + km, m);
+    }
+    
+    /**
+     * Recomputes the right hand side value of a node from its successors
+     * and updates its position in the open heap.
+     */
+    void updateNode(const GridGraph &graph, int start, int node)
+    {
+      if (node != goal) {
+        double best = std::numeric_limits<double>::infinity();
+        for (int i = graph.offsets[node]; i < graph.offsets[node + 1]; i++) {
+          int next = graph.targets[i];
+          best = std::min(best, cost(graph, node, next) + g[next]);
+        }
+        rhs[node] = best;
+      }
+      
+      if (heapIndex[node] != -1)
+        remove(node);
+      if (g[node] != rhs[node])
+        insert(node, calculateKey(graph, start, node));
+    }
+    
+    /**
+     * Returns true when a key still has to be expanded before the path
+     * length from start is known. Nodes on a straight line towards the
+     * start tie with the start and rounding may order them just after
+     * it, so keys up to a small tolerance past the start key are expanded
+     * as well. Keys are ordered exactly everywhere else, so nothing is
+     * pending once the smallest key in the heap is past this bound.
+     */
+    static inline bool isPending(const Key &key, const Key &startKey)
+    {
+      return key.first <= startKey.first + 0.01;
+    }
+    
+    /**
+     * Expands nodes until the path length from start is known.
+     */
+    void computeShortestPath(const GridGraph &graph, int start)
+    {
+      while (!heap.empty() && (isPending(keys[heap[0]], calculateKey(graph, start, start)) || rhs[start] != g[start])) {
+        int node = heap[0];
+        Key oldKey = keys[node];
+        Key newKey = calculateKey(graph, start, node);
+        
+        if (oldKey < newKey) {
+          // Heuristic has changed since the node was inserted
+          remove(node);
+          insert(node, newKey);
+        } else if (g[node] > rhs[node]) {
+          // Overconsistent node, its path length is now known
+          g[node] = rhs[node];
+          remove(node);
+          for (int i = graph.reverseOffsets[node]; i < graph.reverseOffsets[node + 1]; i++) {
+            updateNode(graph, start, graph.reverseTargets[i]);
+          }
+        } else {
+          // Underconsistent node, its path has become longer
+          g[node] = std::numeric_limits<double>::infinity();
+          updateNode(graph, start, node);
+          for (int i = graph.reverseOffsets[node]; i < graph.reverseOffsets[node + 1]; i++) {
+            updateNode(graph, start, graph.reverseTargets[i]);
+          }
+        }
+      }
+    }
+    
+    // Structure version of the graph view the state was computed for
+    unsigned int structure;
+    
+    // Destination node, last start node and key modifier
+    int goal;
+    int last;
+    double km;
+    
+    // Path lengths to destination and their one step lookahead values
+    std::vector<double> g;
+    std::vector<double> rhs;
+    
+    // Links that can't be used by this path
+    std::set<std::pair<int, int> > blocked;
+private:
+    void insert(int node, const Key &key)
+    {
+      keys[node] = key;
+      heapIndex[node] = heap.size();
+      heap.push_back(node);
+      siftUp(heap.size() - 1);
+    }
+    
+    void remove(int node)
+    {
+      int i = heapIndex[node];
+      int moved = heap.back();
+      heap.pop_back();
+      heapIndex[node] = -1;
+      if (moved == node)
+        return;
+      
+      heap[i] = moved;
+      heapIndex[moved] = i;
+      siftUp(i);
+      siftDown(heapIndex[moved]);
+    }
+    
+    void siftUp(int i)
+    {
+      int node = heap[i];
+      while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!(keys[node] < keys[heap[parent]]))
+          break;
+        
+        heap[i] = heap[parent];
+        heapIndex[heap[i]] = i;
+        i = parent;
+      }
+      
+      heap[i] = node;
+      heapIndex[node] = i;
+    }
+    
+    void siftDown(int i)
+    {
+      int node = heap[i];
+      int size = heap.size();
+      for (;;) {
+        int child = 2*i + 1;
+        if (child >= size)
+          break;
+        if (child + 1 < size && keys[heap[child + 1]] < keys[heap[child]])
+          child++;
+        if (!(keys[heap[child]] < keys[node]))
+          break;
+        
+        heap[i] = heap[child];
+        heapIndex[heap[i]] = i;
+        i = child;
+      }
+      
+      heap[i] = node;
+      heapIndex[node] = i;
+    }
+    
+    std::vector<int> heapIndex;
+    std::vector<int> heap;
+    std::vector<Key> keys;
+};
+
+/**
+ * Creates the repair state of a newly planned path, so repairs made while
+ * the path is being followed only have to search what has changed.
+ *
+ * @param graph Graph view the path was planned on
+ * @param goal Destination node index
+ * @param start Start node index
+ * @return Search state with path lengths from start computed
+ */
+static boost::shared_ptr<GridRepairState> seedRepairState(const GridGraph &graph, int goal, int start)
+{
+  boost::shared_ptr<GridRepairState> state(new GridRepairState(graph, goal, start));
+  state->computeShortestPath(graph, start);
+  return state;
+}
+
 inline float waypoint_component(GridWaypoint p, size_t n)
 {
   return p[n];
@@ -139,17 +559,15 @@ GridPath::GridPath()
 
 void GridPath::add(GridNode *node)
 {
-  GridWaypoint wp(node->getLocation());
+  m_pathTree.insert(GridWaypoint(node->getLocation(), m_path.size()));
   m_path.push_back(node);
-  m_pathTree.insert(wp);
-  m_waypointMap[wp] = m_path.size() - 1;
 }
 
 // A predicate for determining if a point is visible
 class path_waypoint_visited {
 public:
-  path_waypoint_visited(const Vector3f &location, int currentIndex, const GridWaypointIndexMap &map)
-    : location(location), currentIndex(currentIndex), map(map)
+  path_waypoint_visited(const Vector3f &location, int currentIndex)
+    : location(location), currentIndex(currentIndex)
   {}
   
   bool operator()(const GridWaypoint &p) const
@@ -160,12 +578,11 @@ public:
     
     Vector3f v = p.getLocation();
     v[2] = location[2];
-    return (location - v).norm() < 24.0f && map.at(p) >= currentIndex;
+    return (location - v).norm() < 24.0f && p.getIndex() >= currentIndex;
   }
 private:
   Vector3f location;
   int currentIndex;
-  GridWaypointIndexMap map;
 };
 
 bool GridPath::visit(const Vector3f &point)
@@ -173,13 +590,12 @@ bool GridPath::visit(const Vector3f &point)
   std::pair<GridTree::const_iterator, float> found = m_pathTree.find_nearest_if(
     GridWaypoint(point),
     100.0,
-    path_waypoint_visited(point, m_currentNode, m_waypointMap)
+    path_waypoint_visited(point, m_currentNode)
   );
   
   if (found.first != m_pathTree.end()) {
     // Found a point, that means it is visited
-    GridWaypoint wp = *found.first;
-    int pointIndex = m_waypointMap.at(wp);
+    int pointIndex = found.first->getIndex();
     
     // Check if we have reached the destination
     if (pointIndex == m_path.size() - 1)
@@ -208,16 +624,260 @@ void GridPath::optimiseTree()
 
 void GridPath::clear()
 {
+  m_repair.reset();
   m_path.clear();
   m_pathTree.clear();
-  m_waypointMap.clear();
   m_destinationReached = false;
   m_currentNode = 0;
 }
 
+GridSpatialHash::GridSpatialHash(float cellSize)
+  : m_cellSize(cellSize),
+    m_buckets(bucket_count),
+    m_size(0)
+{
+}
+
+void GridSpatialHash::insert(const GridWaypoint &wp)
+{
+  Vector3f location = wp.getLocation();
+  boost::uint64_t k = key(cell(location[0]), cell(location[1]), cell(location[2]));
+  
+  // Buckets shared with other copies are never changed, the first insert
+  // into one gives this hash its own copy
+  boost::shared_ptr<CellMap> &cells = m_buckets[boost::hash_value(k) % bucket_count];
+  if (!cells)
+    cells.reset(new CellMap());
+  else if (!cells.unique())
+    cells.reset(new CellMap(*cells));
+  
+  (*cells)[k].push_back(wp);
+  m_size++;
+}
+
+void GridSpatialHash::clear()
+{
+  m_buckets.assign(bucket_count, boost::shared_ptr<CellMap>());
+  m_size = 0;
+}
+
+/**
+ * A search predicate that accepts any waypoint.
+ */
+struct any_waypoint {
+  bool operator()(const GridWaypoint &p) const
+  {
+    return true;
+  }
+};
+
+int GridSpatialHash::findNearest(const Vector3f &location, float radius) const
+{
+  return findNearest(location, radius, any_waypoint());
+}
+
+GridVisitTimes::GridVisitTimes(size_t size, const GridVisitTimes *previous)
+  : m_size(size),
+    m_times(new boost::atomic<timestamp_t>[size])
+{
+  for (size_t i = 0; i < size; i++) {
+    m_times[i].store(previous && i < previous->size() ? previous->get(i) : 0, boost::memory_order_relaxed);
+  }
+}
+
+GridItemIndex::GridItemIndex()
+  : m_typeCounts(Item::BFG + 1),
+    m_tree(std::ptr_fun(waypoint_component)),
+    m_erased(0)
+{
+}
+
+bool GridItemIndex::insert(const Item &item, GridNode *node)
+{
+  boost::unordered_map<Item, int>::const_iterator i = m_slots.find(item);
+  if (i != m_slots.end()) {
+    // Last seen time is not part of item identity, so refresh it in place;
+    // items placed by the map stay persistent when they are seen again
+    GridItem &entry = m_entries[i->second];
+    bool persistent = entry.item.isPersistent();
+    entry = GridItem(item, node);
+    if (persistent)
+      entry.item.setPersistent(true);
+    return false;
+  }
+  
+  int slot;
+  if (m_free.empty()) {
+    slot = m_entries.size();
+    m_entries.push_back(GridItem(item, node));
+  } else {
+    slot = m_free.back();
+    m_free.pop_back();
+    m_entries[slot] = GridItem(item, node);
+  }
+  
+  Vector3f location = item.getLocation();
+  for (int i = 0; i < 3; i++) {
+    m_mins[i] = m_slots.empty() ? location[i] : std::min(m_mins[i], location[i]);
+    m_maxs[i] = m_slots.empty() ? location[i] : std::max(m_maxs[i], location[i]);
+  }
+  
+  m_slots[item] = slot;
+  m_typeCounts[item.getType()]++;
+  m_tree.insert(GridWaypoint(location, slot));
+  return true;
+}
+
+/**
+ * Predicate that matches the tree waypoint of a single item slot.
+ */
+struct item_slot {
+  int slot;
+  
+  item_slot(int slot)
+    : slot(slot)
+  {}
+  
+  bool operator()(const GridWaypoint &p) const
+  {
+    return p.getIndex() == slot;
+  }
+};
+
+bool GridItemIndex::erase(const Item &item)
+{
+  boost::unordered_map<Item, int>::iterator i = m_slots.find(item);
+  if (i == m_slots.end())
+    return false;
+  
+  // Other items may share the location, so look up the waypoint by slot
+  int slot = i->second;
+  std::pair<GridTree::const_iterator, float> found = m_tree.find_nearest_if(
+    GridWaypoint(item.getLocation()), 1.0, item_slot(slot));
+  if (found.first != m_tree.end())
+    m_tree.erase(found.first);
+  
+  m_slots.erase(i);
+  m_typeCounts[item.getType()]--;
+  m_entries[slot].node = NULL;
+  m_free.push_back(slot);
+  
+  // Removals leave the tree unbalanced, so rebuild it once they add up
+  if (++m_erased > m_tree.size()) {
+    m_tree.optimise();
+    m_erased = 0;
+  }
+  
+  return true;
+}
+
+void GridItemIndex::clear()
+{
+  m_entries.clear();
+  m_free.clear();
+  m_slots.clear();
+  m_typeCounts.assign(Item::BFG + 1, 0);
+  m_tree.clear();
+  m_erased = 0;
+}
+
+/**
+ * Orders items by distance from some location.
+ */
+struct item_closer {
+  Vector3f origin;
+  
+  item_closer(const Vector3f &origin)
+    : origin(origin)
+  {}
+  
+  bool operator()(const GridItem &a, const GridItem &b) const
+  {
+    return (a.item.getLocation() - origin).squaredNorm() < (b.item.getLocation() - origin).squaredNorm();
+  }
+};
+
+size_t GridItemIndex::findNearest(const Vector3f &origin, const ItemTypeSet &types, size_t count, timestamp_t since,
+                                  float radius, std::vector<GridItem> *items) const
+{
+  items->clear();
+  if (count == 0)
+    return 0;
+  
+  bool wanted = false;
+  for (size_t type = 0; type < m_typeCounts.size(); type++) {
+    wanted = wanted || (types.test(type) && m_typeCounts[type] > 0);
+  }
+  
+  if (!wanted)
+    return 0;
+  
+  // No item is farther away than the farthest corner of the bounding box
+  Vector3f corner;
+  for (int i = 0; i < 3; i++) {
+    corner[i] = std::max(std::abs(origin[i] - m_mins[i]), std::abs(origin[i] - m_maxs[i]));
+  }
+  float limit = std::min(radius, corner.norm());
+  
+  // Search shells of doubling radius; once a shell holds enough items,
+  // anything outside of it is farther than all of them
+  std::vector<GridWaypoint> found;
+  for (float shell = shell_radius; ; shell *= 2) {
+    float bound = std::min(shell, limit);
+    items->clear();
+    found.clear();
+    m_tree.find_within_range(GridWaypoint(origin), bound, std::back_inserter(found));
+    BOOST_FOREACH(const GridWaypoint &wp, found) {
+      const GridItem &entry = m_entries[wp.getIndex()];
+      if (!entry.node || !types.test(entry.item.getType()) || entry.item.isExpired(since))
+        continue;
+      
+      if ((entry.item.getLocation() - origin).norm() > bound)
+        continue;
+      
+      items->push_back(entry);
+    }
+    
+    if (items->size() >= count || bound >= limit)
+      break;
+  }
+  
+  item_closer closer(origin);
+  if (items->size() > count) {
+    std::partial_sort(items->begin(), items->begin() + count, items->end(), closer);
+    items->erase(items->begin() + count, items->end());
+  } else {
+    std::sort(items->begin(), items->end(), closer);
+  }
+  
+  return items->size();
+}
+
+void GridItemIndex::findExpired(timestamp_t before, std::vector<GridItem> *items) const
+{
+  BOOST_FOREACH(const GridItem &entry, m_entries) {
+    if (entry.node && entry.item.isExpired(before))
+      items->push_back(entry);
+  }
+}
+
+void GridItemIndex::findAll(Item::Type type, timestamp_t since, std::vector<GridItem> *items) const
+{
+  BOOST_FOREACH(const GridItem &entry, m_entries) {
+    if (entry.node && entry.item.getType() == type && !entry.item.isExpired(since))
+      items->push_back(entry);
+  }
+}
+
 Grid::Grid(Map *map)
   : m_map(map),
-    m_tree(std::ptr_fun(waypoint_component))
+    m_lastVisits(new GridVisitTimes(0)),
+    m_graphDirty(true),
+    m_structureDirty(true),
+    m_nodesDirty(false),
+    m_changeCount(0),
+    m_scratch(new GridScratch()),
+    m_cells(cell_radius)
 {
   Object::init();
   
@@ -228,22 +888,477 @@ Grid::Grid(Map *map)
 Grid::~Grid()
 {
   // Free all nodes
-  typedef std::pair<GridWaypoint, GridNode*> WaypointNodePair;
-  BOOST_FOREACH(WaypointNodePair p, m_waypointMap) {
-    delete p.second;
+  BOOST_FOREACH(GridNode *node, m_nodes) {
+    delete node;
   }
 }
 
 void Grid::clear()
 {
   // Free all nodes
-  typedef std::pair<GridWaypoint, GridNode*> WaypointNodePair;
-  BOOST_FOREACH(WaypointNodePair p, m_waypointMap) {
-    delete p.second;
+  BOOST_FOREACH(GridNode *node, m_nodes) {
+    delete node;
   }
   
-  m_tree.clear();
-  m_waypointMap.clear();
+  m_nodes.clear();
+  m_lastVisits.reset(new GridVisitTimes(0));
+  boost::atomic_store(&m_graph, boost::shared_ptr<const GridGraph>());
+  m_graphDirty = true;
+  m_structureDirty = true;
+  m_nodesDirty = false;
+  m_changeCount = 0;
+  m_changedNodes.clear();
+  m_changedFlags.clear();
+  m_flowFields.clear();
+  m_cells.clear();
+  
+  // Item registry refers to the freed nodes
+  m_items.clear();
+}
+
+GridNode *Grid::createNode(const Vector3f &location)
+{
+  GridNode *node = new GridNode(this, m_nodes.size());
+  node->addWaypoint(location);
+  m_nodes.push_back(node);
+  markChanged(node->getId(), false);
+  m_nodesDirty = true;
+  
+  m_cells.insert(GridWaypoint(location, node->getId()));
+  
+  // Published views may still use the visit time array, so it is only
+  // ever replaced with a larger copy and never resized in place
+  if (m_lastVisits->size() < m_nodes.size())
+    m_lastVisits.reset(new GridVisitTimes(2 * m_nodes.size(), m_lastVisits.get()));
+  
+  return node;
+}
+
+void Grid::markChanged(int node, bool structure)
+{
+  if (m_changedFlags.size() < m_nodes.size())
+    m_changedFlags.resize(m_nodes.size(), false);
+  
+  if (!m_changedFlags[node]) {
+    m_changedFlags[node] = true;
+    m_changedNodes.push_back(node);
+    m_changeCount++;
+  }
+  
+  m_graphDirty = true;
+  if (structure)
+    m_structureDirty = true;
+}
+
+float GridGraph::heuristic(int node, int goal) const
+{
+  float h = (locations[node] - locations[goal]).norm();
+  if (!landmarks || node >= landmarks->size || goal >= landmarks->size)
+    return h;
+  
+  // Path length from node to goal is at least the difference of their
+  // distances from or to each landmark; unreachable pairs give no bound
+  const float infinity = std::numeric_limits<float>::infinity();
+  int count = landmarks->count;
+  const float *fromNode = &landmarks->from[node * count];
+  const float *fromGoal = &landmarks->from[goal * count];
+  const float *toNode = &landmarks->to[node * count];
+  const float *toGoal = &landmarks->to[goal * count];
+  for (int l = 0; l < count; l++) {
+    if (fromNode[l] != infinity && fromGoal[l] != infinity)
+      h = std::max(h, fromGoal[l] - fromNode[l]);
+    if (toNode[l] != infinity && toGoal[l] != infinity)
+      h = std::max(h, toNode[l] - toGoal[l]);
+  }
+  
+  return h;
+}
+
+/**
+ * Computes shortest path lengths between the nearest of source nodes and
+ * all other nodes, following the same link rules as the path finding
+ * search.
+ *
+ * @param graph Grid graph view
+ * @param reverse Compute distances to sources instead of from them
+ * @param sources Source node indices
+ * @param search Search state to use
+ * @param out Where to store distances, the distance of node i goes to out[i * stride]
+ * @param stride Distance stride
+ * @param nextHops Optional array where the next node towards the sources is stored
+ *                 when computing distances to sources
+ */
+static void computeDistances(const GridGraph &graph, bool reverse, const std::vector<int> &sources,
+                             GridSearch *search, float *out, int stride, int *nextHops = NULL)
+{
+  const std::vector<int> &offsets = reverse ? graph.reverseOffsets : graph.offsets;
+  const std::vector<int> &targets = reverse ? graph.reverseTargets : graph.targets;
+  
+  search->begin(graph.size());
+  BOOST_FOREACH(int source, sources) {
+    search->costG[source] = 0;
+    search->costF[source] = 0;
+    search->push(source);
+  }
+  
+  while (!search->empty()) {
+    int node = search->pop();
+    out[node * stride] = search->costG[node];
+    
+    for (int i = offsets[node]; i < offsets[node + 1]; i++) {
+      int neigh = targets[i];
+      int state = search->getState(neigh);
+      if (state == GridSearch::Closed)
+        continue;
+      
+      // Skip links going from the ground into the air
+      int from = reverse ? neigh : node;
+      int to = reverse ? node : neigh;
+      if (graph.media[from] == GridNode::Ground && graph.media[to] == GridNode::Air)
+        continue;
+      
+      float score = search->costG[node] + (graph.locations[node] - graph.locations[neigh]).norm();
+      if (state == GridSearch::Unvisited || score < search->costG[neigh]) {
+        search->costG[neigh] = score;
+        search->costF[neigh] = score;
+        search->push(neigh);
+        
+        if (nextHops)
+          nextHops[neigh] = node;
+      }
+    }
+  }
+}
+
+/**
+ * Updates a flow field after sources have been added or removed. Nodes
+ * that led to a removed source lose their distance and are reached again
+ * from their neighbours, while added sources only shorten distances, so
+ * the search is limited to the part of the field that has changed.
+ *
+ * @param graph Grid graph view the field was computed for
+ * @param previous Sorted sources the field was computed for
+ * @param field Flow field holding the new sources
+ */
+static void repairFlowField(const GridGraph &graph, const std::vector<int> &previous, GridFlowField *field)
+{
+  const float infinity = std::numeric_limits<float>::infinity();
+  std::vector<int> added, removed;
+  std::set_difference(field->sources.begin(), field->sources.end(), previous.begin(), previous.end(),
+                      std::back_inserter(added));
+  std::set_difference(previous.begin(), previous.end(), field->sources.begin(), field->sources.end(),
+                      std::back_inserter(removed));
+  
+  typedef std::pair<float, int> Entry;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > queue;
+  std::vector<float> &distances = field->distances;
+  std::vector<int> &nextHops = field->nextHops;
+  
+  if (!removed.empty()) {
+    // Find the source each node leads to by following next hops
+    std::vector<int> owners(graph.size(), -1);
+    std::vector<int> chain;
+    for (int node = 0; node < graph.size(); node++) {
+      int n = node;
+      while (owners[n] == -1 && distances[n] != infinity && nextHops[n] != -1) {
+        chain.push_back(n);
+        n = nextHops[n];
+      }
+      
+      int owner = owners[n] != -1 ? owners[n] : (distances[n] != infinity ? n : -1);
+      owners[n] = owner;
+      BOOST_FOREACH(int c, chain) {
+        owners[c] = owner;
+      }
+      chain.clear();
+    }
+    
+    std::vector<bool> lost(graph.size(), false);
+    for (int node = 0; node < graph.size(); node++) {
+      if (owners[node] != -1 && std::binary_search(removed.begin(), removed.end(), owners[node])) {
+        lost[node] = true;
+        distances[node] = infinity;
+        nextHops[node] = -1;
+      }
+    }
+    
+    // Nodes that kept their distance are exact and seed the lost ones
+    for (int node = 0; node < graph.size(); node++) {
+      if (!lost[node])
+        continue;
+      
+      for (int i = graph.offsets[node]; i < graph.offsets[node + 1]; i++) {
+        int neigh = graph.targets[i];
+        if (distances[neigh] != infinity)
+          queue.push(Entry(distances[neigh], neigh));
+      }
+    }
+  }
+  
+  BOOST_FOREACH(int source, added) {
+    distances[source] = 0;
+    nextHops[source] = -1;
+    queue.push(Entry(0, source));
+  }
+  
+  while (!queue.empty()) {
+    Entry entry = queue.top();
+    queue.pop();
+    int node = entry.second;
+    if (entry.first > distances[node])
+      continue;
+    
+    for (int i = graph.reverseOffsets[node]; i < graph.reverseOffsets[node + 1]; i++) {
+      int neigh = graph.reverseTargets[i];
+      
+      // Skip links going from the ground into the air
+      if (graph.media[neigh] == GridNode::Ground && graph.media[node] == GridNode::Air)
+        continue;
+      
+      float score = distances[node] + (graph.locations[node] - graph.locations[neigh]).norm();
+      if (score < distances[neigh]) {
+        distances[neigh] = score;
+        nextHops[neigh] = node;
+        queue.push(Entry(score, neigh));
+      }
+    }
+  }
+}
+
+/**
+ * Picks landmarks that are spread over the graph, each one being the
+ * node farthest away from the landmarks picked before it, and computes
+ * distances from and to each of them.
+ *
+ * @param graph Grid graph view
+ * @return Landmark distances or an empty pointer for an empty graph
+ */
+static boost::shared_ptr<const GridLandmarks> computeLandmarks(const GridGraph &graph)
+{
+  int nodeCount = graph.size();
+  if (!nodeCount)
+    return boost::shared_ptr<const GridLandmarks>();
+  
+  const float infinity = std::numeric_limits<float>::infinity();
+  boost::shared_ptr<GridLandmarks> landmarks(new GridLandmarks());
+  int count = std::min((int) Grid::landmark_count, nodeCount);
+  landmarks->count = count;
+  landmarks->size = nodeCount;
+  landmarks->from.assign(nodeCount * count, infinity);
+  landmarks->to.assign(nodeCount * count, infinity);
+  
+  // The first landmark is the node farthest away from an arbitrary node
+  GridSearch search;
+  std::vector<int> sources(1, 0);
+  std::vector<float> nearest(nodeCount, infinity);
+  computeDistances(graph, false, sources, &search, &nearest[0], 1);
+  
+  for (int l = 0; l < count; l++) {
+    int landmark = 0;
+    for (int i = 1; i < nodeCount; i++) {
+      if (nearest[i] != infinity && (nearest[landmark] == infinity || nearest[i] > nearest[landmark]))
+        landmark = i;
+    }
+    
+    landmarks->nodes.push_back(landmark);
+    sources[0] = landmark;
+    computeDistances(graph, false, sources, &search, &landmarks->from[l], count);
+    computeDistances(graph, true, sources, &search, &landmarks->to[l], count);
+    
+    // Track the distance from each node to its nearest landmark
+    if (l == 0)
+      std::fill(nearest.begin(), nearest.end(), infinity);
+    
+    for (int i = 0; i < nodeCount; i++) {
+      nearest[i] = std::min(nearest[i], landmarks->from[i * count + l]);
+    }
+  }
+  
+  return landmarks;
+}
+
+bool Grid::needsLandmarks(const GridGraph &graph, timestamp_t now)
+{
+  return !graph.landmarks && graph.size() > 0 && now >= graph.landmarksBuilt + landmark_refresh_interval;
+}
+
+boost::shared_ptr<const GridGraph> Grid::getGraph()
+{
+  boost::shared_ptr<const GridGraph> previous = boost::atomic_load(&m_graph);
+  timestamp_t now = Timing::getCurrentTimestamp();
+  if (previous && !m_graphDirty && !needsLandmarks(*previous, now))
+    return previous;
+  
+  // New nodes are published right away, so they can be found as soon as
+  // they have been learned; a few link and rank changes are batched until
+  // the view gets old, so that learning does not rebuild it on every call
+  bool nodesAdded = m_nodesDirty;
+  if (previous && !nodesAdded && !needsLandmarks(*previous, now) && m_changeCount < graph_rebuild_changes &&
+      now - previous->built < graph_rebuild_interval)
+    return previous;
+  
+  // Only one thread rebuilds the view; while an older view with all nodes
+  // exists, others keep using it instead of waiting for the rebuild or for
+  // writers
+  boost::unique_lock<boost::mutex> publish(m_publishMutex, boost::defer_lock);
+  boost::shared_lock<boost::shared_mutex> g(m_mutex, boost::defer_lock);
+  if (previous && !nodesAdded) {
+    if (!publish.try_lock() || !g.try_lock())
+      return previous;
+  } else {
+    publish.lock();
+    g.lock();
+  }
+  
+  previous = boost::atomic_load(&m_graph);
+  if (previous && !m_graphDirty && !needsLandmarks(*previous, now))
+    return previous;
+  
+  // Copy data of changed nodes while holding the lock, everything else is
+  // carried over from the previous view or built after the lock has been
+  // released; flags are cleared while writers are held off, so every later
+  // change is picked up by the next view
+  bool linksChanged = !previous || m_structureDirty;
+  bool structureChanged = linksChanged || m_nodesDirty;
+  m_graphDirty = false;
+  m_structureDirty = false;
+  m_nodesDirty = false;
+  m_changeCount = 0;
+  
+  int nodeCount = m_nodes.size();
+  int previousCount = previous ? previous->size() : 0;
+  std::vector<int> changed;
+  BOOST_FOREACH(int node, m_changedNodes) {
+    m_changedFlags[node] = false;
+    if (node < previousCount)
+      changed.push_back(node);
+  }
+  m_changedNodes.clear();
+  
+  // New nodes are always copied, a view of an empty grid copies them all
+  for (int i = previousCount; i < nodeCount; i++) {
+    changed.push_back(i);
+  }
+  
+  boost::shared_ptr<GridGraph> graph(new GridGraph());
+  graph->nodes = m_nodes;
+  graph->lastVisits = m_lastVisits;
+  std::vector<int> slots(nodeCount, -1);
+  std::vector<unsigned char> changedMedia, changedTypes;
+  std::vector<bool> changedLinked;
+  std::vector<int> linkOffsets;
+  std::vector<std::pair<int, float> > links;
+  for (size_t k = 0; k < changed.size(); k++) {
+    GridNode *node = m_nodes[changed[k]];
+    slots[changed[k]] = k;
+    changedMedia.push_back(node->getMedium());
+    changedTypes.push_back(node->getType());
+    changedLinked.push_back(node->isLinked());
+    linkOffsets.push_back(links.size());
+    
+    typedef std::pair<GridNode*, GridLink*> NodeLinkPair;
+    BOOST_FOREACH(const NodeLinkPair &p, node->links()) {
+      links.push_back(std::make_pair(p.first->getId(), p.second->getRank()));
+    }
+  }
+  linkOffsets.push_back(links.size());
+  g.unlock();
+  
+  // Node locations never change, so they are carried over from the
+  // previous view and only new nodes are appended
+  if (previous) {
+    graph->locations = previous->locations;
+    graph->media = previous->media;
+    graph->types = previous->types;
+    graph->linked = previous->linked;
+  }
+  
+  graph->locations.reserve(nodeCount);
+  for (int i = graph->locations.size(); i < nodeCount; i++) {
+    graph->locations.push_back(graph->nodes[i]->getLocation());
+  }
+  
+  graph->media.resize(nodeCount);
+  graph->types.resize(nodeCount);
+  graph->linked.resize(nodeCount);
+  for (size_t k = 0; k < changed.size(); k++) {
+    graph->media[changed[k]] = changedMedia[k];
+    graph->types[changed[k]] = changedTypes[k];
+    graph->linked[changed[k]] = changedLinked[k];
+  }
+  
+  // Only cell buckets that new nodes fall into are copied, the rest is
+  // shared with the previous view
+  if (previous && previous->cells->size() == static_cast<size_t>(nodeCount)) {
+    graph->cells = previous->cells;
+  } else {
+    boost::shared_ptr<GridSpatialHash> cells(previous ? new GridSpatialHash(*previous->cells) : new GridSpatialHash(cell_radius));
+    for (int i = cells->size(); i < nodeCount; i++) {
+      cells->insert(GridWaypoint(graph->locations[i], i));
+    }
+    graph->cells = cells;
+  }
+  
+  // Links of unchanged nodes are copied from the previous view; links are
+  // stored in order of target index so searches expand nodes in a
+  // deterministic order
+  for (size_t k = 0; k < changed.size(); k++) {
+    std::sort(links.begin() + linkOffsets[k], links.begin() + linkOffsets[k + 1]);
+  }
+  
+  graph->offsets.resize(nodeCount + 1);
+  graph->targets.reserve((previous ? previous->targets.size() : 0) + links.size());
+  graph->ranks.reserve(graph->targets.capacity());
+  for (int i = 0; i < nodeCount; i++) {
+    graph->offsets[i] = graph->targets.size();
+    if (slots[i] == -1) {
+      int first = previous->offsets[i], last = previous->offsets[i + 1];
+      graph->targets.insert(graph->targets.end(), previous->targets.begin() + first, previous->targets.begin() + last);
+      graph->ranks.insert(graph->ranks.end(), previous->ranks.begin() + first, previous->ranks.begin() + last);
+    } else {
+      for (int j = linkOffsets[slots[i]]; j < linkOffsets[slots[i] + 1]; j++) {
+        graph->targets.push_back(links[j].first);
+        graph->ranks.push_back(links[j].second);
+      }
+    }
+  }
+  int linkCount = graph->targets.size();
+  graph->offsets[nodeCount] = linkCount;
+  
+  // Reversed links for distances towards nodes
+  graph->reverseOffsets.assign(nodeCount + 1, 0);
+  graph->reverseTargets.resize(linkCount);
+  for (int i = 0; i < linkCount; i++) {
+    graph->reverseOffsets[graph->targets[i] + 1]++;
+  }
+  for (int i = 0; i < nodeCount; i++) {
+    graph->reverseOffsets[i + 1] += graph->reverseOffsets[i];
+  }
+  std::vector<int> fill(graph->reverseOffsets.begin(), graph->reverseOffsets.end() - 1);
+  for (int i = 0; i < nodeCount; i++) {
+    for (int j = graph->offsets[i]; j < graph->offsets[i + 1]; j++) {
+      graph->reverseTargets[fill[graph->targets[j]]++] = i;
+    }
+  }
+  
+  graph->structure = !structureChanged ? previous->structure : previous ? previous->structure + 1 : 1;
+  graph->built = now;
+  
+  // Landmark bounds only hold for the links they were computed on, so they
+  // are dropped as soon as links change and the heuristic falls back to
+  // straight line distances until they are computed again; new nodes
+  // without links don't change any distances
+  graph->landmarksBuilt = previous ? previous->landmarksBuilt : 0;
+  if (!linksChanged)
+    graph->landmarks = previous->landmarks;
+  
+  if (needsLandmarks(*graph, now)) {
+    graph->landmarks = computeLandmarks(*graph);
+    graph->landmarksBuilt = now;
+  }
+  
+  boost::atomic_store(&m_graph, boost::shared_ptr<const GridGraph>(graph));
+  return graph;
 }
 
 void Grid::learnWaypoints(const std::vector<Vector3f> &locs)
@@ -260,10 +1375,7 @@ void Grid::learnWaypoints(const std::vector<Vector3f> &locs)
     hasPrevious = true;
   }
   
-  // Optimise the tree as we might have added a lot of new nodes
-  m_tree.optimise();
-  
-  getLogger()->info(format("Learned %d waypoints, currently holding %d grid nodes.") % locs.size() % m_tree.size());
+  getLogger()->info(format("Learned %d waypoints, currently holding %d grid nodes.") % locs.size() % m_cells.size());
 }
 
 void Grid::learnWaypoints(const Vector3f &locA, const Vector3f &locB)
@@ -284,136 +1396,250 @@ void Grid::learnWaypoints(const Vector3f &locA, const Vector3f &locB)
   b->addLink(a, 0.1);
 }
 
-void Grid::learnLocation(const Vector3f &loc)
+void Grid::learnLocation(const Vector3f &loc)
+{
+  // Simply request a node by location and if one doesn't yet exist, a new node
+  // will be created
+  getNodeByLocation(loc);
+}
+
+void Grid::learnItem(GridNode *node, const Item &item)
+{
+  boost::unique_lock<boost::shared_mutex> g(m_mutex);
+  
+  // Node attributes are copied into graph views by readers, so they are
+  // only changed while holding the grid lock
+  node->m_type = GridNode::Item;
+  node->addItem(item);
+  markChanged(node->getId(), false);
+  
+  if (m_items.insert(item, node))
+    invalidateFlowField(item.getType());
+}
+
+void Grid::learnItem(GridNode *node)
+{
+  boost::unique_lock<boost::shared_mutex> g(m_mutex);
+  
+  // Register new items in this node and refresh the ones already known
+  BOOST_FOREACH(const Item &item, node->items()) {
+    if (m_items.insert(item, node))
+      invalidateFlowField(item.getType());
+  }
+}
+
+void Grid::learnEntities()
+{
+  static const Vector3f item_mins(-15, -15, -15);
+  static const Vector3f item_maxs(15, 15, 15);
+  int items = 0;
+  int spawnPoints = 0;
+  
+  BOOST_FOREACH(const MapEntity &entity, m_map->getEntities()) {
+    if (Item::isItemClass(entity.classname)) {
+      // Items are dropped to the floor by the game when spawned, so do the
+      // same to get the location where they will actually be seen
+      Vector3f drop = entity.origin - Vector3f(0, 0, 128);
+      float f = m_map->traceBox(entity.origin, drop, item_mins, item_maxs, Map::Solid);
+      Vector3f origin = entity.origin + f * (drop - entity.origin);
+      
+      // Placed items respawn where they are, so they never expire
+      GridNode *node = getNodeByLocation(origin);
+      Item item = Item::forClassName(entity.classname);
+      item.setLocation(origin);
+      item.setPersistent(true);
+      learnItem(node, item);
+      items++;
+    } else if (entity.classname == "info_player_deathmatch" || entity.classname == "info_player_start") {
+      // Spawn point, the node type is changed under the grid lock
+      GridNode *node = getNodeByLocation(entity.origin);
+      node->setType(GridNode::SpawnPoint);
+      spawnPoints++;
+    }
+  }
+  
+  getLogger()->info(format("Registered %d items and %d spawn points placed in the map.") % items % spawnPoints);
+}
+
+void Grid::learnMap()
 {
-  // Simply request a node by location and if one doesn't yet exist, a new node
-  // will be created
-  getNodeByLocation(loc);
+  int faces = 0;
+  int links = 0;
+  Vector3f height(0, 0, player_height);
+  
+  for (int i = 0; i < m_map->getFaceCount(); i++) {
+    MapFace *face = m_map->getFace(i);
+    if (!(face->getType() & 0x00000001))
+      continue;
+    
+    // Every walkable face gets a node even when it is not linked
+    Vector3f origin = face->getOrigin() + height;
+    getNodeByLocation(origin)->setLinked();
+    faces++;
+    
+    // Follow face links through their interpolated origins
+    BOOST_FOREACH(MapLink *link, face->links()) {
+      MapFace *target = link->getFace();
+      if (!(target->getType() & 0x00000001))
+        continue;
+      
+      Vector3f via = link->getOrigin() + height;
+      if (learnWalkable(origin, via) && learnWalkable(via, target->getOrigin() + height))
+        links++;
+    }
+  }
+  
+  getLogger()->info(format("Generated grid from %d walkable faces and %d face links, currently holding %d grid nodes.") % faces % links % m_cells.size());
 }
 
-void Grid::learnItem(GridNode *node)
+bool Grid::learnWalkable(const Vector3f &locA, const Vector3f &locB)
 {
-  // Register all new items in this node
-  BOOST_FOREACH(Item item, node->items()) {
-    if (m_items.find(item.getType()) == m_items.end()) {
-      m_items[item.getType()] = GridTree(std::ptr_fun(waypoint_component));
+  static const Vector3f hull_mins(-16, -16, -player_height + step_height);
+  static const Vector3f hull_maxs(16, 16, 32);
+  
+  // Player hull with its bottom raised by a step must fit through
+  if (m_map->traceBox(locA, locB, hull_mins, hull_maxs, Map::Solid) < 1.0)
+    return false;
+  
+  std::vector<Vector3f> locs;
+  locs.push_back(locA);
+  
+  if (locA[2] - locB[2] <= step_height) {
+    // Walking, there must be ground beneath every sample
+    Vector3f delta = locB - locA;
+    int samples = (int) (delta.norm() / sample_spacing);
+    for (int i = 1; i <= samples; i++) {
+      Vector3f p = locA + delta * ((float) i / (samples + 1));
+      if (!m_map->isGroundBelow(p))
+        return false;
+      
+      locs.push_back(p);
     }
+  }
+  
+  locs.push_back(locB);
+  for (size_t i = 1; i < locs.size(); i++) {
+    GridNode *a = getNodeByLocation(locs[i - 1]);
+    GridNode *b = getNodeByLocation(locs[i]);
+    if (a == b)
+      continue;
     
-    GridWaypoint wp(item.getLocation());
-    if (m_items[item.getType()].find(wp) == m_items[item.getType()].end()) {
-      m_items[item.getType()].insert(wp);
-      m_itemWaypointMap[wp] = node;
-    }
+    // Generated links have not been tested, so they start with the
+    // lower rank used for untested links
+    a->setLinked();
+    b->setLinked();
+    a->addLink(b, 0.1);
   }
   
-  // Register node as item-holding node for later expiry checks
-  m_itemNodes.insert(node);
+  return true;
 }
 
 void Grid::collectAllExpired()
 {
+  boost::unique_lock<boost::shared_mutex> g(m_mutex);
   timestamp_t now = Timing::getCurrentTimestamp();
+  if (now < item_expiry_time)
+    return;
   
   // Remove all expired items
-  BOOST_FOREACH(GridNode *node, m_itemNodes) {
-    std::list<Item> queue;
-    
-    BOOST_FOREACH(Item item, node->items()) {
-      if (now - item.getLastSeen() > item_expiry_time)
-        queue.push_back(item);
-    }
-    
-    BOOST_FOREACH(Item &item, queue) {
-      GridWaypoint wp(item.getLocation());
-      m_items[item.getType()].erase(wp);
-      m_itemWaypointMap.erase(wp);
-      node->removeItem(item);
-    }
+  std::vector<GridItem> expired;
+  m_items.findExpired(now - item_expiry_time, &expired);
+  BOOST_FOREACH(const GridItem &entry, expired) {
+    m_items.erase(entry.item);
+    entry.node->removeItem(entry.item);
+    invalidateFlowField(entry.item.getType());
   }
 }
 
 GridNode *Grid::getNodeByLocation(const Vector3f &loc, bool create)
 {
-  boost::unique_lock<boost::shared_mutex> g(m_mutex);
-  GridWaypoint target(loc);
   GridNode *node = NULL;
-  std::pair<GridTree::const_iterator, float> found = m_tree.find_nearest(target, cell_radius);
-  if (found.first == m_tree.end()) {
-    // No existing waypoints found in that location, create a new node
-    if (create) {
-      node = new GridNode(this);
+  {
+    // Lookups only exclude other writers, readers copying node data for a
+    // new graph view are only held off while the grid is actually changed
+    boost::upgrade_lock<boost::shared_mutex> g(m_mutex);
+    GridWaypoint target(loc);
+    int found = m_cells.findNearest(loc, cell_radius);
+    if (found != -1) {
+      node = m_nodes[found];
+      if (node->waypoints().find(target) != node->waypoints().end())
+        return node;
+    } else if (!create) {
+      return NULL;
+    }
+    
+    boost::upgrade_to_unique_lock<boost::shared_mutex> u(g);
+    if (node) {
+      // At least one waypoint has been found, it carries the associated node
       node->addWaypoint(target);
-      node->evaluateMedium();
-      m_tree.insert(target);
-      m_waypointMap[target] = node;
+      return node;
     }
-  } else {
-    // At least one waypoint has been found, lookup associated node
-    GridWaypoint wp = *found.first;
-    node = m_waypointMap[wp];
-    node->addWaypoint(target);
+    
+    // No existing waypoints found in that location, create a new node
+    node = createNode(loc);
   }
   
+  // Medium is evaluated once the grid is unlocked, as setting it locks
+  // the grid again
+  node->evaluateMedium();
   return node;
 }
 
 // A search predicate that only selects nodes that are linked
 class require_linked_node {
 public:
-    require_linked_node(const GridWaypointNodeMap &map)
-      : map(map)
+    require_linked_node(const GridGraph &graph)
+      : graph(graph)
     {}
     
     bool operator()(const GridWaypoint &p) const
     {
-      return map.at(p)->isLinked();
+      return graph.linked[p.getIndex()];
     }
 private:
-    GridWaypointNodeMap map;
+    const GridGraph &graph;
 };
 
-GridNode *Grid::getNearestNode(const Vector3f &loc, float radius, bool onlyLinked)
+int GridGraph::findNearest(const Vector3f &loc, float radius, bool onlyLinked) const
 {
-  GridWaypoint target(loc);
-  GridNode *node = NULL;
-  std::pair<GridTree::const_iterator, float> found;
-  
   if (onlyLinked)
-    found = m_tree.find_nearest_if(target, radius, require_linked_node(m_waypointMap));
-  else
-    found = m_tree.find_nearest(target, radius);
-  
-  if (found.first != m_tree.end()) {
-    GridWaypoint wp = *found.first;
-    node = m_waypointMap[wp];
-  }
+    return cells->findNearest(loc, radius, require_linked_node(*this));
   
-  return node;
+  return cells->findNearest(loc, radius);
+}
+
+GridNode *Grid::getNearestNode(const Vector3f &loc, float radius, bool onlyLinked)
+{
+  boost::shared_ptr<const GridGraph> graph = getGraph();
+  int found = graph->findNearest(loc, radius, onlyLinked);
+  return found != -1 ? graph->nodes[found] : NULL;
 }
 
 void Grid::exportGrid(GridExporter *exporter)
 {
-  typedef std::pair<GridWaypoint, GridNode*> WaypointNodePair;
-  typedef std::pair<GridNode*, GridLink*> NodeLinkPair;
-  
-  exporter->open(m_waypointMap.size());
-  
-  BOOST_FOREACH(WaypointNodePair p, m_waypointMap) {
-    exporter->exportNode(p.second);
+  {
+    boost::shared_lock<boost::shared_mutex> g(m_mutex);
+    exporter->open(m_nodes.size());
     
-    BOOST_FOREACH(GridWaypoint wp, p.second->waypoints()) {
-      exporter->exportWaypoint(p.second, wp);
+    BOOST_FOREACH(GridNode *node, m_nodes) {
+      exporter->exportNode(node);
+      
+      BOOST_FOREACH(GridWaypoint wp, node->waypoints()) {
+        exporter->exportWaypoint(node, wp);
+      }
     }
-  }
-  
-  exporter->startLinks();
-  
-  BOOST_FOREACH(WaypointNodePair p, m_waypointMap) {
-    BOOST_FOREACH(NodeLinkPair r, p.second->links()) {
-      exporter->exportLink(p.second, r.second);
+    
+    exporter->startLinks();
+    
+    typedef std::pair<GridNode*, GridLink*> NodeLinkPair;
+    BOOST_FOREACH(GridNode *node, m_nodes) {
+      BOOST_FOREACH(const NodeLinkPair &p, node->links()) {
+        exporter->exportLink(node, p.second);
+      }
     }
   }
   
+  // Exporters that buffer the grid write it out without holding the lock
   exporter->close();
 }
 
@@ -425,6 +1651,18 @@ void Grid::importGrid(const std::string &filename)
     return;
   }
   
+  // Binary grids are recognized by their header
+  int32_t ident = 0;
+  in.read(reinterpret_cast<char*>(&ident), sizeof(ident));
+  if (in.gcount() == sizeof(ident) && ident == IDGRIDHEADER) {
+    in.close();
+    importBinaryGrid(filename);
+    return;
+  }
+  
+  in.clear();
+  in.seekg(0);
+  
   int waypointCount = 0;
   int nodeCount = 0;
   int linkCount = 0;
@@ -443,11 +1681,8 @@ void Grid::importGrid(const std::string &filename)
       in >> location[1];
       in >> location[2];
       
-      GridNode *node = new GridNode(this);
-      node->addWaypoint(location);
+      GridNode *node = createNode(location);
       node->m_linked = true;
-      m_tree.insert(location);
-      m_waypointMap[location] = node;
       nodeIds[nodeId] = node;
       nodeCount++;
     } else if (type == "WAYPOINT") {
@@ -479,52 +1714,185 @@ void Grid::importGrid(const std::string &filename)
     }
   }
   
-  // Optimise the tree
-  m_tree.optimise();
-  
   // Evaluate media for all nodes
-  typedef std::pair<GridWaypoint, GridNode*> WaypointNodePair;
-  BOOST_FOREACH(WaypointNodePair p, m_waypointMap) {
-    p.second->evaluateMedium();
+  BOOST_FOREACH(GridNode *node, m_nodes) {
+    node->evaluateMedium();
+  }
+  
+  getLogger()->info(format("Imported %d grid nodes, %d grid links and %d waypoints.") % nodeCount % linkCount % waypointCount);
+}
+
+/**
+ * Returns true if a grid file section holds exactly count elements of
+ * the given size and lies within the file.
+ */
+static bool isValidSection(const GridFormat::grid_dir_entry_t &entry, size_t count, size_t elementSize, size_t fileSize)
+{
+  return entry.offset >= 0 && entry.offset % 4 == 0 && entry.size >= 0 &&
+         static_cast<size_t>(entry.size) == count * elementSize &&
+         static_cast<size_t>(entry.offset) + entry.size <= fileSize;
+}
+
+bool Grid::importBinaryGrid(const std::string &filename)
+{
+  using namespace GridFormat;
+  
+  int fh = ::open(filename.c_str(), O_RDONLY);
+  if (fh == -1) {
+    getLogger()->error("Failed to import the mapping grid.");
+    return false;
+  }
+  
+  struct stat st;
+  if (fstat(fh, &st) == -1) {
+    ::close(fh);
+    getLogger()->error("Failed to import the mapping grid.");
+    return false;
+  }
+  
+  size_t fileSize = st.st_size;
+  void *data = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fh, 0);
+  ::close(fh);
+  if (data == MAP_FAILED) {
+    getLogger()->error(format("Error mapping grid %s!") % filename);
+    return false;
+  }
+  
+  // Validate header and all sections before touching the grid
+  const char *base = static_cast<const char*>(data);
+  const grid_header_t *header = reinterpret_cast<const grid_header_t*>(base);
+  if (fileSize >= sizeof(grid_header_t) && header->ident == IDGRIDHEADER && header->version != GRIDVERSION) {
+    munmap(data, fileSize);
+    getLogger()->error(format("Grid %s has unsupported version %d!") % filename % header->version);
+    return false;
+  }
+  
+  bool valid = fileSize >= sizeof(grid_header_t) && header->ident == IDGRIDHEADER &&
+               header->numnodes >= 0 && header->numwaypoints >= 0 && header->numlinks >= 0;
+  
+  size_t nodeCount = valid ? header->numnodes : 0;
+  valid = valid &&
+    isValidSection(header->nodes, nodeCount, sizeof(grid_node_t), fileSize) &&
+    isValidSection(header->waypoints, header->numwaypoints, sizeof(grid_waypoint_t), fileSize) &&
+    isValidSection(header->linkoffsets, nodeCount + 1, sizeof(int32_t), fileSize) &&
+    isValidSection(header->links, header->numlinks, sizeof(grid_link_t), fileSize) &&
+    isValidSection(header->media, nodeCount, sizeof(uint8_t), fileSize) &&
+    isValidSection(header->types, nodeCount, sizeof(uint8_t), fileSize);
+  
+  const grid_node_t *nodes = NULL;
+  const grid_waypoint_t *waypoints = NULL;
+  const int32_t *linkOffsets = NULL;
+  const grid_link_t *links = NULL;
+  const uint8_t *media = NULL;
+  const uint8_t *types = NULL;
+  int waypointCount = 0;
+  int linkCount = 0;
+  
+  if (valid) {
+    nodes = reinterpret_cast<const grid_node_t*>(base + header->nodes.offset);
+    waypoints = reinterpret_cast<const grid_waypoint_t*>(base + header->waypoints.offset);
+    linkOffsets = reinterpret_cast<const int32_t*>(base + header->linkoffsets.offset);
+    links = reinterpret_cast<const grid_link_t*>(base + header->links.offset);
+    media = reinterpret_cast<const uint8_t*>(base + header->media.offset);
+    types = reinterpret_cast<const uint8_t*>(base + header->types.offset);
+    waypointCount = header->numwaypoints;
+    linkCount = header->numlinks;
+    
+    valid = linkOffsets[0] == 0 && linkOffsets[nodeCount] == linkCount;
+    for (size_t i = 0; valid && i < nodeCount; i++) {
+      valid = linkOffsets[i] <= linkOffsets[i + 1] && media[i] <= GridNode::Water && types[i] <= GridNode::Item;
+    }
+    for (int i = 0; valid && i < linkCount; i++) {
+      valid = links[i].target >= 0 && static_cast<size_t>(links[i].target) < nodeCount;
+    }
+    for (int i = 0; valid && i < waypointCount; i++) {
+      valid = waypoints[i].node >= 0 && static_cast<size_t>(waypoints[i].node) < nodeCount;
+    }
+  }
+  
+  if (!valid) {
+    munmap(data, fileSize);
+    getLogger()->error(format("Grid %s is truncated or corrupted!") % filename);
+    return false;
+  }
+  
+  clear();
+  
+  {
+    boost::unique_lock<boost::shared_mutex> g(m_mutex);
+    
+    // Create all nodes, they are linked with the rest of the map as in
+    // the text format
+    m_nodes.reserve(nodeCount);
+    m_lastVisits.reset(new GridVisitTimes(nodeCount));
+    for (size_t i = 0; i < nodeCount; i++) {
+      Vector3f location(nodes[i].location[0], nodes[i].location[1], nodes[i].location[2]);
+      GridNode *node = new GridNode(this, i);
+      node->addWaypoint(location);
+      node->m_medium = static_cast<GridNode::Medium>(media[i]);
+      node->m_type = static_cast<GridNode::Type>(types[i]);
+      node->m_linked = true;
+      m_nodes.push_back(node);
+      m_cells.insert(GridWaypoint(location, i));
+    }
+    
+    for (int i = 0; i < waypointCount; i++) {
+      const grid_waypoint_t &wp = waypoints[i];
+      m_nodes[wp.node]->addWaypoint(Vector3f(wp.location[0], wp.location[1], wp.location[2]));
+    }
+    
+    // Links are already grouped by source node
+    for (size_t i = 0; i < nodeCount; i++) {
+      GridLinkMap &nodeLinks = m_nodes[i]->m_links;
+      for (int j = linkOffsets[i]; j < linkOffsets[i + 1]; j++) {
+        GridNode *target = m_nodes[links[j].target];
+        GridLink *&link = nodeLinks[target];
+        if (link)
+          link->reinforce(links[j].rank);
+        else
+          link = new GridLink(target, links[j].rank);
+      }
+    }
+    
+    m_graphDirty = true;
+    m_structureDirty = true;
+  }
+  
+  munmap(data, fileSize);
+  
+  // Media that were not known at export time are evaluated now
+  BOOST_FOREACH(GridNode *node, m_nodes) {
+    if (node->getMedium() == GridNode::Unknown)
+      node->evaluateMedium();
   }
   
   getLogger()->info(format("Imported %d grid nodes, %d grid links and %d waypoints.") % nodeCount % linkCount % waypointCount);
+  return true;
 }
 
 // A search predicate that only selects nodes with specific medium
 class require_medium {
 public:
-    require_medium(const GridWaypointNodeMap &map, GridNode::Medium medium)
-      : map(map), medium(medium)
+    require_medium(const GridGraph &graph, GridNode::Medium medium)
+      : graph(graph), medium(medium)
     {}
     
     bool operator()(const GridWaypoint &p) const
     {
-      GridNode *node = map.at(p);
-      return node->isLinked() && node->getMedium() == medium;
+      int node = p.getIndex();
+      return graph.linked[node] && graph.media[node] == medium;
     }
 private:
-    GridWaypointNodeMap map;
+    const GridGraph &graph;
     GridNode::Medium medium;
 };
 
 
 GridNode *Grid::getNodeByMedium(const Vector3f &loc, GridNode::Medium medium, float radius)
 {
-  GridWaypoint target(loc);
-  GridNode *node = NULL;
-  std::pair<GridTree::const_iterator, float> found = m_tree.find_nearest_if(
-    target,
-    radius,
-    require_medium(m_waypointMap, medium)
-  );
-  
-  if (found.first != m_tree.end()) {
-    GridWaypoint wp = *found.first;
-    node = m_waypointMap[wp];
-  }
-  
-  return node;
+  boost::shared_ptr<const GridGraph> graph = getGraph();
+  int found = graph->cells->findNearest(loc, radius, require_medium(*graph, medium));
+  return found != -1 ? graph->nodes[found] : NULL;
 }
 
 /**
@@ -534,111 +1902,92 @@ struct gridnode_cmp {
   /**
    * Function object. These benefit from inlining.
    *
-   * @param a Pointer to GridNode
-   * @param b Pointer to GridNode
+   * @param a Node index and its last visit time
+   * @param b Node index and its last visit time
    * @result True if a was less recently visited than b and false otherwise
    */
-  bool operator()(GridNode* a, GridNode* b) const {
-    return a->getLastVisit() < b->getLastVisit();
+  bool operator()(const std::pair<int, timestamp_t> &a, const std::pair<int, timestamp_t> &b) const {
+    return a.second < b.second;
   }
 };
 
-GridNode* Grid::pickNextNode(GridNode *start, const std::set<GridNode*> &visitedNodes, bool randomize) const
+int Grid::pickNextNode(const GridGraph &graph, int start, const std::vector<bool> &visitedNodes, bool randomize) const
 {
-  GridLinkMap links = start->links();
-  if (links.size() == 0)
-    return NULL;
-
-  typedef std::pair<GridNode*, GridLink*> NodeLinkPair;
-
+  int first = graph.offsets[start];
+  int last = graph.offsets[start + 1];
+  if (first == last)
+    return -1;
+  
+  // Skip links going from the ground into the air
+  bool ground = graph.media[start] == GridNode::Ground;
+  
   if (randomize) {
     // Pick a point at random
-
-    int randomElement = rollDie(0, links.size() - 1);  
-    int counter = 0;
-
-    // Choose random node    
-    BOOST_FOREACH(NodeLinkPair p, links) {
-      // Skip links going from the ground into the air
-      if (start->isGround() && p.first->isAir()) {
-        counter++;
-        continue;
-      }
-          
-      if (counter == randomElement && visitedNodes.find(p.first) == visitedNodes.end())
-        return p.first;
-      
-      counter++;
-    }
-
+    int i = first + rollDie(0, last - first - 1);
+    int next = graph.targets[i];
+    if (!(ground && graph.media[next] == GridNode::Air) && !visitedNodes[next])
+      return next;
+    
     // Pick the first node that was not visited yet, don't care for randomness at this point
-    BOOST_FOREACH(NodeLinkPair p, links) {
-      // Skip links going from the ground into the air
-      if (start->isGround() && p.first->isAir())
-        continue;
-      
-      if (visitedNodes.find(p.first) == visitedNodes.end()) 
-        return p.first;      
+    for (i = first; i < last; i++) {
+      next = graph.targets[i];
+      if (!(ground && graph.media[next] == GridNode::Air) && !visitedNodes[next])
+        return next;
     }
   } else {
-    // Pick a point that was the least recently visited
-    std::vector<GridNode*> linkNodes;
-
-    BOOST_FOREACH(NodeLinkPair p, links) {
-      // Skip links going from the ground into the air
-      if (start->isGround() && p.first->isAir())
-        continue;
-
-      linkNodes.push_back(p.first);
+    // Pick a point that was the least recently visited; visit times may
+    // change at any time, so they are read once before sorting
+    std::vector<std::pair<int, timestamp_t> > linkNodes;
+    for (int i = first; i < last; i++) {
+      int next = graph.targets[i];
+      if (!(ground && graph.media[next] == GridNode::Air))
+        linkNodes.push_back(std::make_pair(next, graph.lastVisits->get(next)));
     }
-
-    // Sort grid nodes,
+    
+    // Sort grid nodes
     std::sort(linkNodes.begin(), linkNodes.end(), gridnode_cmp());
-
-    BOOST_FOREACH(GridNode *node, linkNodes) {
-      if (visitedNodes.find(node) == visitedNodes.end())
-        return node;
+    
+    typedef std::pair<int, timestamp_t> NodeVisit;
+    BOOST_FOREACH(const NodeVisit &next, linkNodes) {
+      if (!visitedNodes[next.first])
+        return next.first;
     }
   }
-
+  
   // Cycle detected when trying to pick next node in path. We will have to backtrack.
-  return NULL;
+  return -1;
 }
 
 bool Grid::computeRandomPath(const Vector3f &start, GridPath *path, bool randomize)
 {
-  boost::shared_lock<boost::shared_mutex> g(m_mutex);
-
   // Clear previous path
   path->clear();
 
-  GridNode *startNode = getNearestNode(start); 
-  GridNode *node = startNode;
-  GridNode *nextNode;
-  std::set<GridNode*> visitedNodes;
-
-  if (startNode == NULL) {
+  boost::shared_ptr<const GridGraph> graph = getGraph();
+  int node = graph->findNearest(start, 100, true);
+  if (node == -1) {
     // Start node is not known so we can't navigate from there
     return false;
   }
 
+  std::vector<bool> visitedNodes(graph->size(), false);
   int pathSize = rollDie(100, 200);
-  std::vector<GridNode*> tmp;
+  std::vector<int> tmp;
   tmp.push_back(node);
 
   for (int i = 0; i < pathSize; i++) {
-    visitedNodes.insert(node);
-
+    visitedNodes[node] = true;
+    
     // Resolve cycle
-    while ((nextNode = pickNextNode(node, visitedNodes, randomize)) == NULL) {
+    int nextNode;
+    while ((nextNode = pickNextNode(*graph, node, visitedNodes, randomize)) == -1) {
       // Start backtracking; pop the cycle node from path but leave
       // it in visitedNodes, so it doesn't get entered again
-      tmp.pop_back();     
+      tmp.pop_back();
+      if (tmp.empty())
+        return false;
       
       node = tmp.back();
-
-      if (tmp.size() == 0)
-        return false;
     }
     
     tmp.push_back(nextNode);
@@ -646,16 +1995,18 @@ bool Grid::computeRandomPath(const Vector3f &start, GridPath *path, bool randomi
   }
   
   // Populate the path structure  
-  BOOST_FOREACH(GridNode *n, tmp) {
-    path->add(n);
+  BOOST_FOREACH(int n, tmp) {
+    path->add(graph->nodes[n]);
   }
   
   path->optimiseTree();
+  path->m_repair = seedRepairState(*graph, tmp.back(), tmp.front());
   return true;
 }
 
 int Grid::rollDie(int from, int to) const
 {
+  boost::lock_guard<boost::mutex> g(m_genMutex);
   boost::uniform_int<> dist(from, to);
   boost::variate_generator<boost::mt19937&, boost::uniform_int<> > die(m_gen, dist);
   return die();
@@ -663,127 +2014,274 @@ int Grid::rollDie(int from, int to) const
 
 bool Grid::findPath(const Vector3f &start, const Vector3f &end, GridPath *path, bool full)
 {
-  boost::shared_lock<boost::shared_mutex> g(m_mutex);
-  
   // Clear previous path
   path->clear();
   
-  GridNode *startNode = getNearestNode(start);
-  GridNode *endNode = getNearestNode(end);
-  if (startNode == NULL || endNode == NULL) {
+  boost::shared_ptr<const GridGraph> graph = getGraph();
+  int startId = graph->findNearest(start, 100, true);
+  int endId = graph->findNearest(end, 100, true);
+  if (startId == -1 || endId == -1) {
     // Start or end node are not known so we can't navigate there
     return false;
   }
   
-  // Convenience data type for comparisons
-  typedef std::pair<float, GridNode*> CostGridNode;
-  typedef std::pair<GridNode*, GridLink*> NodeLink;
+  // Search state is borrowed from this grid, so it is reused between
+  // searches without being kept for every thread
+  ScratchLease<GridSearch> search(m_scratch->searches);
   
-  boost::unordered_map<GridNode*, float> costF, costG;
-  std::priority_queue<CostGridNode, std::vector<CostGridNode>, std::greater<CostGridNode> > open;
-  boost::unordered_map<GridNode*, bool> openMap;
-  boost::unordered_map<GridNode*, bool> closed;
-  boost::unordered_map<GridNode*, NodeLink> reversePath;
   bool found = false;
   
   // Initialize A* search
-  costG[startNode] = 0;
-  costF[startNode] = startNode->heuristic(endNode);
-  open.push(CostGridNode(costF[startNode], startNode));
-  openMap[startNode] = true;
+  search->begin(graph->size());
+  search->costG[startId] = 0;
+  search->costF[startId] = graph->heuristic(startId, endId);
+  search->parentNode[startId] = -1;
+  search->push(startId);
   
-  while (!open.empty()) {
-    CostGridNode cgn = open.top();
-    GridNode *node = cgn.second;
-    open.pop();
-    openMap.erase(node);
+  while (!search->empty()) {
+    int node = search->pop();
     
     // Check goal condition
-    if (node == endNode) {
+    if (node == endId) {
       found = true;
       if (!full)
         return true;
       break;
     }
     
-    closed[node] = true;
-    
     // Check all links
-    BOOST_FOREACH(NodeLink p, node->links()) {
-      GridNode *neigh = p.first;
-      if (closed.find(neigh) != closed.end())
+    const Vector3f &location = graph->locations[node];
+    bool ground = graph->media[node] == GridNode::Ground;
+    for (int i = graph->offsets[node]; i < graph->offsets[node + 1]; i++) {
+      int neigh = graph->targets[i];
+      int state = search->getState(neigh);
+      if (state == GridSearch::Closed)
         continue;
       
       // Skip links going from the ground into the air
-      if (node->isGround() && neigh->isAir())
+      if (ground && graph->media[neigh] == GridNode::Air)
         continue;
       
-      bool better = false;
-      float score = costG[node] + 1.0 * (node->getLocation() - neigh->getLocation()).norm(); // TODO use rank
-      if (openMap.find(neigh) == openMap.end()) {
-        better = true;
-      } else if (score < costG[neigh]) {
-        better = true;
-      }
-      
-      if (better) {
-        reversePath[neigh] = NodeLink(node, p.second);
-        costG[neigh] = score;
-        costF[neigh] = score + neigh->heuristic(endNode);
-        open.push(CostGridNode(costF[neigh], neigh));
-        openMap[neigh] = true;
+      // Links are weighted by their length only; ranks count how often a
+      // link was traversed and would make the landmark heuristic inadmissible
+      float score = search->costG[node] + (location - graph->locations[neigh]).norm();
+      if (state == GridSearch::Unvisited || score < search->costG[neigh]) {
+        search->parentNode[neigh] = node;
+        search->costG[neigh] = score;
+        search->costF[neigh] = score + graph->heuristic(neigh, endId);
+        search->push(neigh);
       }
     }
   }
   
   // When a path has been found, reconstruct it
   if (found) {
-    GridNode *node = endNode;
-    std::vector<GridNode*> tmp;
-    
-    while (node != startNode) {
+    std::vector<int> &tmp = search->path;
+    tmp.clear();
+    for (int node = endId; node != -1; node = search->parentNode[node]) {
       tmp.push_back(node);
-      
-      if (reversePath.find(node) != reversePath.end()) {
-        NodeLink fl = reversePath[node];
-        node = fl.first;
-      } else {
-        return false;
-      }
     }
     
-    // Insert origin face
-    tmp.push_back(startNode);
-    
     // Reverse everything
-    BOOST_REVERSE_FOREACH(GridNode *node, tmp) {
-      path->add(node);
+    BOOST_REVERSE_FOREACH(int node, tmp) {
+      path->add(graph->nodes[node]);
     }
     path->optimiseTree();
+    path->m_repair = seedRepairState(*graph, endId, startId);
     return true;
   }
   
   return found;
 }
 
-GridNode *Grid::getNearestItemNode(Item::Type type, const Vector3f &origin)
+void Grid::invalidateFlowField(Item::Type type)
 {
-  // First check if tree of this type is actually available
-  if (m_items.find(type) == m_items.end())
-    return NULL;
+  boost::lock_guard<boost::mutex> g(m_graphMutex);
+  m_itemVersions[type]++;
+}
 
-  // It is, so perform a lookup
-  GridWaypoint target(origin);
-  GridTree tree = m_items.at(type);
-  GridNode *node = NULL;
+boost::shared_ptr<const GridFlowField> Grid::getFlowField(Item::Type type, const GridGraph &graph)
+{
+  // A field for the same structure is current when no items have changed
+  // since it was computed and is repaired otherwise
+  boost::shared_ptr<const GridFlowField> previous;
+  {
+    boost::lock_guard<boost::mutex> g(m_graphMutex);
+    boost::unordered_map<Item::Type, boost::shared_ptr<const GridFlowField> >::const_iterator i = m_flowFields.find(type);
+    if (i != m_flowFields.end() && i->second->structure == graph.structure) {
+      if (i->second->version == m_itemVersions[type])
+        return i->second;
+      
+      previous = i->second;
+    }
+  }
+  
+  // Nodes holding an unexpired item of this type are the sources; items
+  // are only registered under the grid lock, which is held just while
+  // they are collected
+  std::vector<GridItem> items;
+  unsigned int version;
+  {
+    boost::shared_lock<boost::shared_mutex> g(m_mutex);
+    timestamp_t now = Timing::getCurrentTimestamp();
+    m_items.findAll(type, now > item_expiry_time ? now - item_expiry_time : 0, &items);
+    
+    boost::lock_guard<boost::mutex> gg(m_graphMutex);
+    version = m_itemVersions[type];
+  }
+  
+  boost::shared_ptr<GridFlowField> field(new GridFlowField());
+  field->structure = graph.structure;
+  field->version = version;
+  BOOST_FOREACH(const GridItem &entry, items) {
+    if (entry.node->getId() < graph.size())
+      field->sources.push_back(entry.node->getId());
+  }
+  
+  std::sort(field->sources.begin(), field->sources.end());
+  field->sources.erase(std::unique(field->sources.begin(), field->sources.end()), field->sources.end());
+  
+  // Distances and next hops towards the nearest source over reversed links
+  if (previous) {
+    field->distances = previous->distances;
+    field->nextHops = previous->nextHops;
+    repairFlowField(graph, previous->sources, field.get());
+  } else {
+    field->distances.assign(graph.size(), std::numeric_limits<float>::infinity());
+    field->nextHops.assign(graph.size(), -1);
+    if (!field->sources.empty()) {
+      GridSearch search;
+      computeDistances(graph, true, field->sources, &search, &field->distances[0], 1, &field->nextHops[0]);
+    }
+  }
+  
+  // Items may have changed while the field was computed, in which case
+  // it is used once but not kept; neither is a field for an older view
+  boost::lock_guard<boost::mutex> g(m_graphMutex);
+  boost::unordered_map<Item::Type, boost::shared_ptr<const GridFlowField> >::iterator i = m_flowFields.find(type);
+  if (m_itemVersions[type] == version) {
+    if (i == m_flowFields.end())
+      m_flowFields[type] = field;
+    else if (i->second->structure <= graph.structure)
+      i->second = field;
+  }
+  
+  return field;
+}
 
-  std::pair<GridTree::const_iterator, float> found = tree.find_nearest(target);
-  if (found.first != tree.end()) {
-    GridWaypoint wp = *found.first;
-    node = m_itemWaypointMap[wp];
+bool Grid::findItemPath(Item::Type type, const Vector3f &start, GridPath *path, float *distance)
+{
+  // Clear previous path
+  path->clear();
+  
+  boost::shared_ptr<const GridGraph> graph = getGraph();
+  int node = graph->findNearest(start, 100, true);
+  if (node == -1) {
+    // Start node is not known so we can't navigate from there
+    return false;
+  }
+  
+  boost::shared_ptr<const GridFlowField> field = getFlowField(type, *graph);
+  if (field->distances[node] == std::numeric_limits<float>::infinity())
+    return false;
+  
+  if (distance)
+    *distance = field->distances[node];
+  
+  // Follow next hops until an item node is reached
+  int startId = node;
+  for (; node != -1; node = field->nextHops[node]) {
+    path->add(graph->nodes[node]);
   }
+  
+  path->optimiseTree();
+  path->m_repair = seedRepairState(*graph, path->m_path.back()->getId(), startId);
+  return true;
+}
 
-  return node;
+bool Grid::repairPath(const Vector3f &start, GridPath *path, bool blocked)
+{
+  // Repairs are made while the path is being followed, so they use the
+  // last published graph view instead of building a new one
+  boost::shared_ptr<const GridGraph> graph = boost::atomic_load(&m_graph);
+  boost::shared_ptr<GridRepairState> state = path->m_repair;
+  if (!graph || !state || state->structure != graph->structure || path->m_path.empty()) {
+    // Search state is missing or stale, the path must be planned again
+    return false;
+  }
+  
+  int startId = graph->findNearest(start, 100, true);
+  int goal = path->m_path.back()->getId();
+  if (startId == -1 || state->goal != goal) {
+    // Start node is not known so we can't navigate from there
+    return false;
+  }
+  
+  // Link that we were following when we got stuck
+  std::pair<int, int> link(-1, -1);
+  if (blocked && path->m_currentNode > 0)
+    link = std::make_pair(path->m_path[path->m_currentNode - 1]->getId(), path->m_path[path->m_currentNode]->getId());
+  
+  // Start has moved, keys of open nodes are corrected lazily
+  state->km += (graph->locations[state->last] - graph->locations[startId]).norm();
+  state->last = startId;
+  if (link.first != -1 && state->blocked.insert(link).second)
+    state->updateNode(*graph, startId, link.first);
+  
+  state->computeShortestPath(*graph, startId);
+  path->clear();
+  path->m_repair = state;
+  if (state->g[startId] == std::numeric_limits<double>::infinity())
+    return false;
+  
+  // Nodes on the shortest path from start are consistent once the search
+  // is done, so following the cheapest successors leads to the destination
+  int node = startId;
+  for (int steps = 0; node != goal; steps++) {
+    path->add(graph->nodes[node]);
+    
+    int best = -1;
+    double bestCost = std::numeric_limits<double>::infinity();
+    for (int i = graph->offsets[node]; i < graph->offsets[node + 1]; i++) {
+      int next = graph->targets[i];
+      double cost = state->cost(*graph, node, next) + state->g[next];
+      if (cost < bestCost) {
+        best = next;
+        bestCost = cost;
+      }
+    }
+    
+    if (best == -1 || steps >= graph->size())
+      return false;
+    
+    node = best;
+  }
+  
+  path->add(graph->nodes[goal]);
+  path->optimiseTree();
+  return true;
+}
+
+GridNode *Grid::getNearestItemNode(Item::Type type, const Vector3f &origin)
+{
+  ItemTypeSet types;
+  types.set(type);
+  
+  std::vector<GridItem> items;
+  if (!findNearestItems(origin, types, 1, &items))
+    return NULL;
+  
+  return items[0].node;
+}
+
+size_t Grid::findNearestItems(const Vector3f &origin, const ItemTypeSet &types, size_t count, std::vector<GridItem> *items,
+                              float radius)
+{
+  boost::shared_lock<boost::shared_mutex> g(m_mutex);
+  timestamp_t now = Timing::getCurrentTimestamp();
+  timestamp_t since = now > item_expiry_time ? now - item_expiry_time : 0;
+  
+  return m_items.findNearest(origin, types, count, since, radius, items);
 }
 
 }
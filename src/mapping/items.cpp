@@ -10,11 +10,13 @@
 namespace HiveMind {
 
 boost::unordered_map<std::string, Item::Type> Item::m_modelMap;
+boost::unordered_map<std::string, Item::Type> Item::m_classMap;
 
 Item::Item(Type type)
   : m_type(type),
     m_weapon(type > WeaponStart),
-    m_lastSeen(Timing::getCurrentTimestamp())
+    m_lastSeen(Timing::getCurrentTimestamp()),
+    m_persistent(false)
 {
 }
 
@@ -61,6 +63,59 @@ Item Item::forModel(const std::string &model)
   return Item(m_modelMap.at(model));
 }
 
+void Item::initClassMap()
+{
+  if (m_classMap.size())
+    return;
+  
+  // Items
+  m_classMap["item_health"         ] = MediumHealth;
+  m_classMap["item_health_large"   ] = LargeHealth;
+  m_classMap["item_health_small"   ] = StimPack;
+  m_classMap["item_health_mega"    ] = MegaHealth;
+  m_classMap["item_adrenaline"     ] = Adrenaline;
+  m_classMap["ammo_bullets"        ] = Bullets;
+  m_classMap["ammo_cells"          ] = Cells;
+  m_classMap["ammo_grenades"       ] = Grenades;
+  m_classMap["ammo_rockets"        ] = Rockets;
+  m_classMap["ammo_shells"         ] = Shells;
+  m_classMap["ammo_slugs"          ] = Slugs;
+  m_classMap["item_armor_body"     ] = BodyArmor;
+  m_classMap["item_armor_combat"   ] = CombatArmor;
+  m_classMap["item_armor_jacket"   ] = JacketArmor;
+  m_classMap["item_power_screen"   ] = PowerScreen;
+  m_classMap["item_armor_shard"    ] = ArmorShard;
+  m_classMap["item_power_shield"   ] = PowerShield;
+  m_classMap["item_bandolier"      ] = Bandolier;
+  m_classMap["item_invulnerability"] = Invulnerability;
+  m_classMap["item_pack"           ] = Backpack;
+  m_classMap["item_quad"           ] = Quad;
+  m_classMap["item_silencer"       ] = Silencer;
+  
+  // Weapons
+  m_classMap["weapon_shotgun"        ] = Shotgun;
+  m_classMap["weapon_supershotgun"   ] = SuperShotgun;
+  m_classMap["weapon_machinegun"     ] = Machinegun;
+  m_classMap["weapon_chaingun"       ] = Chaingun;
+  m_classMap["weapon_grenadelauncher"] = GrenadeLauncher;
+  m_classMap["weapon_rocketlauncher" ] = RocketLauncher;
+  m_classMap["weapon_hyperblaster"   ] = HyperBlaster;
+  m_classMap["weapon_railgun"        ] = Railgun;
+  m_classMap["weapon_bfg"            ] = BFG;
+}
+
+bool Item::isItemClass(const std::string &classname)
+{
+  initClassMap();
+  return m_classMap.find(classname) != m_classMap.end();
+}
+
+Item Item::forClassName(const std::string &classname)
+{
+  initClassMap();
+  return Item(m_classMap.at(classname));
+}
+
 }
 
 
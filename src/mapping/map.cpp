@@ -8,44 +8,436 @@
  */
 #include "mapping/map.h"
 #include "mapping/bsp.h"
+#include "mapping/scratch.h"
 #include "context.h"
 #include "logger.h"
 
 #include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <vector>
+#include <list>
 #include <set>
 #include <queue>
 #include <algorithm>
+#include <fstream>
+#include <map>
+#include <limits>
+#include <cmath>
 
+#include <boost/atomic.hpp>
 #include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace HiveMind::BSP;
 
 namespace HiveMind {
 
-// Private map attributes
+/**
+ * Ray cache key. Coordinates are quantized, so traces that differ by
+ * less than the cache quantum share the same key.
+ */
+struct ray_cache_key_t {
+  int32_t start[3];
+  int32_t end[3];
+  int32_t mins[3];
+  int32_t maxs[3];
+  int32_t mask;
+  int32_t box;
+  int32_t generation;
+  
+  bool operator==(const ray_cache_key_t &other) const
+  {
+    return std::equal(start, start + 3, other.start) && std::equal(end, end + 3, other.end) &&
+           std::equal(mins, mins + 3, other.mins) && std::equal(maxs, maxs + 3, other.maxs) &&
+           mask == other.mask && box == other.box && generation == other.generation;
+  }
+};
+
+static std::size_t hash_value(const ray_cache_key_t &key)
+{
+  const int32_t *data = key.start;
+  return boost::hash_range(data, data + sizeof(ray_cache_key_t) / sizeof(int32_t));
+}
+
+/**
+ * A vertex of a face polygon projected to the XY plane.
+ */
+struct face_vertex_t {
+  float x;
+  float y;
+};
+
+/**
+ * A walkable face outline projected to the XY plane together with its
+ * bounding box. Vertices of all polygons are stored contiguously.
+ */
+struct face_polygon_t {
+  int face;
+  float mins[2];
+  float maxs[2];
+  int firstVertex;
+  int numVertices;
+};
+
+/**
+ * A link discovered during map linking.
+ */
+struct MapLinkCandidate {
+  int face;
+  Vector3f origin;
+};
+
+// Contents grid parameters
+enum {
+  contents_cell_size = 16,
+  contents_brick_size = 8,
+  contents_brick_cells = contents_brick_size * contents_brick_size * contents_brick_size,
+  contents_max_cells = 1 << 22,
+  contents_ground_cells = 3,
+  contents_ground_search_cells = 4
+};
+
+// Contents grid cell flag marking cells whose samples have different contents
+static const uint16_t contents_mixed = 0x100;
+
+// Contents grid cell flag marking cells with solid ground less than 50 units below
+static const uint16_t contents_ground = 0x200;
+
+// Contents grid cell flag marking cells that may have solid ground 50 units below
+static const uint16_t contents_ground_maybe = 0x400;
+
+// Contents grid cell bits holding brush contents
+static const uint16_t contents_mask = 0xff;
+
+// Contents grid brick table flag marking uniform bricks
+static const uint32_t contents_uniform = 0x80000000;
+
+// Ray cache entries in least recently used order
+typedef std::list<std::pair<ray_cache_key_t, float> > RayCacheList;
+
+// Number of independently locked ray cache shards
+static const size_t ray_cache_shards = 16;
+
+/**
+ * One shard of the ray cache. Keys are distributed over shards by their
+ * hash, so bots tracing at the same time rarely wait for each other.
+ */
+struct RayCacheShard {
+  RayCacheShard()
+    : hits(0),
+      misses(0)
+  {}
+  
+  boost::mutex mutex;
+  RayCacheList entries;
+  boost::unordered_map<ray_cache_key_t, RayCacheList::iterator> index;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/**
+ * Reusable A* search state over map faces. All per-face arrays are indexed
+ * by face index and are only valid for faces stamped with the current
+ * search generation, so nothing needs to be cleared between searches.
+ */
+class MapSearch {
+public:
+    // Per-face search states
+    enum { Unvisited = 0, Open, Closed };
+    
+    /**
+     * Prepares the search state for a new search over the given number
+     * of faces.
+     */
+    void begin(size_t faces)
+    {
+      if (generation.size() != faces) {
+        generation.assign(faces, 0);
+        costG.resize(faces);
+        costF.resize(faces);
+        parentFace.resize(faces);
+        parentLink.resize(faces);
+        state.resize(faces);
+        heapIndex.resize(faces);
+        current = 0;
+      }
+      
+      if (++current == 0) {
+        // Generation counter wrapped around, stamps must be reset
+        std::fill(generation.begin(), generation.end(), 0);
+        current = 1;
+      }
+      
+      heap.clear();
+    }
+    
+    /**
+     * Returns the search state of a face.
+     */
+    inline int getState(int face) const
+    {
+      return generation[face] == current ? state[face] : Unvisited;
+    }
+    
+    /**
+     * Inserts a face into the open heap or moves it up when its cost
+     * has decreased.
+     */
+    void push(int face)
+    {
+      if (getState(face) != Open) {
+        generation[face] = current;
+        state[face] = Open;
+        heapIndex[face] = heap.size();
+        heap.push_back(face);
+      }
+      
+      siftUp(heapIndex[face]);
+    }
+    
+    /**
+     * Removes the face with the lowest cost estimate from the open heap
+     * and marks it as closed.
+     */
+    int pop()
+    {
+      int face = heap[0];
+      heap[0] = heap.back();
+      heapIndex[heap[0]] = 0;
+      heap.pop_back();
+      if (!heap.empty())
+        siftDown(0);
+      
+      state[face] = Closed;
+      return face;
+    }
+    
+    /**
+     * Returns true when there are no more open faces.
+     */
+    inline bool empty() const { return heap.empty(); }
+    
+    // Per-face search data
+    std::vector<float> costG;
+    std::vector<float> costF;
+    std::vector<int> parentFace;
+    std::vector<MapLink*> parentLink;
+private:
+    void siftUp(int i)
+    {
+      int face = heap[i];
+      while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (costF[heap[parent]] <= costF[face])
+          break;
+        
+        heap[i] = heap[parent];
+        heapIndex[heap[i]] = i;
+        i = parent;
+      }
+      
+      heap[i] = face;
+      heapIndex[face] = i;
+    }
+    
+    void siftDown(int i)
+    {
+      int face = heap[i];
+      int size = heap.size();
+      for (;;) {
+        int child = 2*i + 1;
+        if (child >= size)
+          break;
+        if (child + 1 < size && costF[heap[child + 1]] < costF[heap[child]])
+          child++;
+        if (costF[face] <= costF[heap[child]])
+          break;
+        
+        heap[i] = heap[child];
+        heapIndex[heap[i]] = i;
+        i = child;
+      }
+      
+      heap[i] = face;
+      heapIndex[face] = i;
+    }
+    
+    std::vector<unsigned int> generation;
+    std::vector<unsigned char> state;
+    std::vector<int> heapIndex;
+    std::vector<int> heap;
+    unsigned int current;
+};
+
+/**
+ * Per-thread box trace state; brushes that are referenced by multiple
+ * leafs are only clipped against once per trace.
+ */
+struct brush_checks_t {
+  std::vector<int> checks;
+  int count;
+};
+
+/**
+ * Search and trace state owned by a single Map instance. Concurrent
+ * callers each borrow their own state, which is released when the
+ * instance is destroyed.
+ */
+class MapScratch {
+public:
+    ScratchPool<MapSearch> searches;
+    ScratchPool<brush_checks_t> brushChecks;
+};
+
+// Private map attributes; these are shared between all Map instances for
+// the same map and are read-only once the map has been opened
 class MapPrivate {
 public:
-    // Loaded map info
-    int planeCount;
-    plane_t *planes;
-    int vertexCount;
-    vertex_t *vertices;
-    int nodeCount;
-    node_t *nodes;
-    int faceCount;
-    face_t *faces;
-    int leaffaceCount;
-    unsigned short *leaffaces;
-    int leafCount;
-    leaf_t *leafs;
-    int edgeCount;
-    edge_t *edges;
-    int surfedgeCount;
-    int *surfedges;
-    int modelCount;
-    model_t *models;
+    MapPrivate()
+      : pak(NULL),
+        pakSize(0),
+        edgefaces(NULL),
+        edgefriends(NULL),
+        xedges(NULL),
+        clusterCount(0),
+        clusterRowSize(0),
+        hasContentsGrid(false),
+        rayCacheCapacity(4096),
+        rayCacheQuantum(4.0),
+        rayCacheGeneration(0)
+    {}
+    
+    ~MapPrivate()
+    {
+      BOOST_FOREACH(MapLink *link, links) {
+        delete link;
+      }
+      
+      BOOST_FOREACH(MapFace *face, xfaces) {
+        delete face;
+      }
+      
+      free(edgefaces);
+      free(edgefriends);
+      free(xedges);
+      
+      // Release the PAK mapping; all lump views become invalid after this
+      if (pak)
+        munmap(pak, pakSize);
+    }
+    
+    /**
+     * Builds a ray cache key for the given trace.
+     */
+    ray_cache_key_t rayCacheKey(const Vector3f &start, const Vector3f &end, const Vector3f &mins,
+                                const Vector3f &maxs, int mask, bool box) const
+    {
+      // The generation is published after the quantum, so a key never
+      // combines a new generation with an old quantum
+      ray_cache_key_t key;
+      key.generation = rayCacheGeneration.load(boost::memory_order_acquire);
+      float quantum = rayCacheQuantum.load(boost::memory_order_relaxed);
+      for (int i = 0; i < 3; i++) {
+        key.start[i] = (int32_t) floor(start[i] / quantum);
+        key.end[i] = (int32_t) floor(end[i] / quantum);
+        key.mins[i] = (int32_t) floor(mins[i]);
+        key.maxs[i] = (int32_t) floor(maxs[i]);
+      }
+      key.mask = mask;
+      key.box = box;
+      return key;
+    }
+    
+    /**
+     * Looks up a cached trace result and marks it as recently used.
+     *
+     * @param key Cache key
+     * @param fraction Where to store the cached fraction
+     * @return True on cache hit
+     */
+    bool rayCacheLookup(const ray_cache_key_t &key, float *fraction)
+    {
+      RayCacheShard &shard = rayCacheShard(key);
+      boost::lock_guard<boost::mutex> g(shard.mutex);
+      boost::unordered_map<ray_cache_key_t, RayCacheList::iterator>::iterator i = shard.index.find(key);
+      if (i == shard.index.end()) {
+        shard.misses++;
+        return false;
+      }
+      
+      shard.entries.splice(shard.entries.begin(), shard.entries, i->second);
+      *fraction = i->second->second;
+      shard.hits++;
+      return true;
+    }
+    
+    /**
+     * Inserts a trace result into the cache, evicting the least recently
+     * used entries when the cache is full.
+     *
+     * @param key Cache key
+     * @param fraction Traced fraction
+     */
+    void rayCacheInsert(const ray_cache_key_t &key, float fraction)
+    {
+      size_t capacity = (rayCacheCapacity.load(boost::memory_order_relaxed) + ray_cache_shards - 1) / ray_cache_shards;
+      RayCacheShard &shard = rayCacheShard(key);
+      boost::lock_guard<boost::mutex> g(shard.mutex);
+      if (shard.index.find(key) != shard.index.end())
+        return;
+      
+      shard.entries.push_front(std::make_pair(key, fraction));
+      shard.index[key] = shard.entries.begin();
+      while (shard.entries.size() > capacity) {
+        shard.index.erase(shard.entries.back().first);
+        shard.entries.pop_back();
+      }
+    }
+    
+    /**
+     * Returns the ray cache shard responsible for the given key.
+     */
+    RayCacheShard &rayCacheShard(const ray_cache_key_t &key)
+    {
+      return rayCacheShards[hash_value(key) % ray_cache_shards];
+    }
+    
+    // Memory-mapped PAK datafile that contains the map
+    void *pak;
+    size_t pakSize;
+    
+    // Loaded map info (read-only views into the mapped PAK)
+    Lump<plane_t> planes;
+    Lump<vertex_t> vertices;
+    Lump<node_t> nodes;
+    Lump<face_t> faces;
+    Lump<unsigned short> leaffaces;
+    Lump<leaf_t> leafs;
+    Lump<unsigned short> leafbrushes;
+    Lump<brush_t> brushes;
+    Lump<brushside_t> brushsides;
+    Lump<edge_t> edges;
+    Lump<int> surfedges;
+    Lump<model_t> models;
+    Lump<area_t> areas;
+    Lump<areaportal_t> areaportals;
+    Lump<unsigned char> vislist;
+    Lump<char> entityText;
     
     // Computed map info
     std::vector<MapFace*> xfaces;
@@ -55,8 +447,213 @@ public:
     int *edgefriends;
     xedge_t *xedges;
     std::vector<int> sortededges;
+    
+    // Walkable face polygons of each leaf; polygons of leaf i are found
+    // between leafPolygons[i] and leafPolygons[i + 1]
+    std::vector<int> leafPolygons;
+    std::vector<face_polygon_t> polygons;
+    std::vector<face_vertex_t> polygonVertices;
+    
+    // Area of each face (-1 when unknown) and the abstract area graph
+    // used for hierarchical path finding
+    std::vector<int> faceAreas;
+    std::vector<Vector3f> areaOrigins;
+    std::vector<std::vector<int> > areaNeighbours;
+    
+    // Decompressed potentially visible sets, one row of bits per cluster
+    int clusterCount;
+    int clusterRowSize;
+    std::vector<unsigned char> pvs;
+    
+    // Entities placed in the map
+    std::vector<MapEntity> entities;
+    
+    // Sparse contents grid; bricks of cells that all have the same value
+    // are stored in the brick table itself, others point to brick data
+    bool hasContentsGrid;
+    Vector3f gridOrigin;
+    int gridBricks[3];
+    std::vector<uint32_t> gridBrickTable;
+    std::vector<uint16_t> gridCells;
+    
+    /**
+     * Returns the contents grid cell that contains a point or -1 when the
+     * point is not covered by the grid.
+     */
+    int gridCell(const Vector3f &point) const
+    {
+      if (!hasContentsGrid)
+        return -1;
+      
+      int cell[3], brick[3];
+      for (int i = 0; i < 3; i++) {
+        float c = (point[i] - gridOrigin[i]) / contents_cell_size;
+        if (c < 0 || c >= gridBricks[i] * contents_brick_size)
+          return -1;
+        
+        cell[i] = (int) c;
+        brick[i] = cell[i] / contents_brick_size;
+        cell[i] %= contents_brick_size;
+      }
+      
+      uint32_t entry = gridBrickTable[(brick[2] * gridBricks[1] + brick[1]) * gridBricks[0] + brick[0]];
+      if (entry & contents_uniform)
+        return entry & 0xffff;
+      
+      return gridCells[entry * contents_brick_cells +
+                       (cell[2] * contents_brick_size + cell[1]) * contents_brick_size + cell[0]];
+    }
+    
+    // Ray cache; the settings are read without locking, entries created
+    // under an older generation are never matched again
+    RayCacheShard rayCacheShards[ray_cache_shards];
+    boost::atomic<size_t> rayCacheCapacity;
+    boost::atomic<float> rayCacheQuantum;
+    boost::atomic<int32_t> rayCacheGeneration;
+};
+
+/**
+ * An entry in the registry of opened maps. Its mutex is held while the map
+ * is being opened, so only bots opening the same map wait for each other.
+ */
+struct MapRegistryEntry {
+  boost::mutex mutex;
+  boost::weak_ptr<MapPrivate> data;
+};
+
+// Process-wide registry of opened maps, keyed by game directory and map
+// name; map data expires when the last Map using it is destroyed
+static boost::mutex map_registry_mutex;
+static std::map<std::string, boost::shared_ptr<MapRegistryEntry> > map_registry;
+
+/**
+ * Sets up a typed view for a lump that is contained in a BSP file. The
+ * lump is checked against the BSP boundaries so truncated or corrupted
+ * files are rejected instead of being read past their end.
+ *
+ * @param bsp Start of the BSP file
+ * @param bspSize Size of the BSP file
+ * @param entry Lump directory entry
+ * @param lump Where to store the view
+ * @return True if the lump is valid
+ */
+template <typename T>
+static bool mapLump(const char *bsp, long bspSize, const bsp_dir_entry_t &entry, Lump<T> *lump)
+{
+  if (entry.offset < 0 || entry.size < 0 || entry.offset + entry.size > bspSize)
+    return false;
+  
+  if (entry.size % sizeof(T) != 0)
+    return false;
+  
+  *lump = Lump<T>(bsp + entry.offset, entry.size / sizeof(T));
+  return true;
+}
+
+// Link cache format identification
+static const uint32_t link_cache_magic = 0x434d4d48; // "HMMC"
+static const uint32_t link_cache_version = 1;
+
+/**
+ * Link cache file header.
+ */
+struct link_cache_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;
+  uint32_t faceCount;
+  uint32_t edgeCount;
+  uint32_t linkCount;
+  uint32_t edgefriendCount;
+};
+
+/**
+ * A serialized map face.
+ */
+struct link_cache_face_t {
+  int32_t type;
+  float origin[3];
+  uint32_t linkCount;
+};
+
+/**
+ * A serialized map link.
+ */
+struct link_cache_link_t {
+  int32_t face;
+  float origin[3];
+};
+
+// Contents cache format identification
+static const uint32_t contents_cache_magic = 0x43434d48; // "HMCC"
+static const uint32_t contents_cache_version = 1;
+
+/**
+ * Contents cache file header.
+ */
+struct contents_cache_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;
+  float origin[3];
+  int32_t bricks[3];
+  uint32_t brickCount;
+  uint32_t cellCount;
 };
 
+template <typename T>
+static inline void writeRaw(std::ostream &out, const T *data, size_t count = 1)
+{
+  out.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+}
+
+template <typename T>
+static inline bool readRaw(std::istream &in, T *data, size_t count = 1)
+{
+  in.read(reinterpret_cast<char*>(data), count * sizeof(T));
+  return in.good();
+}
+
+/**
+ * Updates a 64-bit FNV-1a hash with a block of data.
+ */
+static uint64_t fnvHash(uint64_t hash, const void *data, size_t size)
+{
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  
+  return hash;
+}
+
+/**
+ * Creates a uniquely named temporary file next to a cache file. Caches
+ * are written there first and then atomically renamed over the old
+ * cache, so concurrently starting bots never see or write into a
+ * partial file.
+ *
+ * @param filename Cache filename
+ * @param tmpFilename Where to store the temporary filename
+ * @return True if the temporary file has been created
+ */
+static bool createCacheTempFile(const std::string &filename, std::string *tmpFilename)
+{
+  std::vector<char> tmpName(filename.begin(), filename.end());
+  const char suffix[] = ".XXXXXX";
+  tmpName.insert(tmpName.end(), suffix, suffix + sizeof(suffix));
+  int fd = mkstemp(&tmpName[0]);
+  if (fd == -1)
+    return false;
+  
+  // Temporary files are private by default, the cache is not
+  fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  close(fd);
+  *tmpFilename = &tmpName[0];
+  return true;
+}
+
 MapFace::MapFace(int index)
   : m_index(index),
     m_type(0),
@@ -64,21 +661,26 @@ MapFace::MapFace(int index)
 {
 }
 
-MapLink::MapLink(MapFace *face, const Vector3f &origin)
-  : m_cost(1.0),
-    m_lastVisited(0),
+MapLink::MapLink(int index, MapFace *face, const Vector3f &origin)
+  : m_index(index),
     m_face(face),
-    m_valid(true),
     m_origin(origin)
 {
 }
 
-void MapLink::updateVisited()
+MapLinkState::MapLinkState()
+  : m_valid(true),
+    m_lastVisited(0),
+    m_cost(1.0)
+{
+}
+
+void MapLinkState::updateVisited()
 {
   m_lastVisited = Timing::getCurrentTimestamp();
 }
 
-void MapLink::applyCost(float cost)
+void MapLinkState::applyCost(float cost)
 {
   m_cost *= cost;
 }
@@ -95,7 +697,8 @@ Map::Map(Context *context, const std::string &name)
   : m_context(context),
     m_loaded(false),
     m_name(name),
-    d(new MapPrivate())
+    d(new MapPrivate()),
+    m_scratch(new MapScratch())
 {
   Object::init();
   
@@ -111,7 +714,6 @@ Map::Map(Context *context, const std::string &name)
 
 Map::~Map()
 {
-  // TODO free stuff
 }
 
 bool Map::open()
@@ -119,129 +721,178 @@ bool Map::open()
   if (m_loaded)
     return true;
   
+  // Reuse map data that has already been opened by another context in
+  // this process; concurrently starting bots wait on the map's entry for
+  // the first one instead of loading and linking the same map again
+  std::string key = m_context->getGameDir() + "/" + m_name;
+  boost::shared_ptr<MapRegistryEntry> entry;
+  {
+    boost::lock_guard<boost::mutex> g(map_registry_mutex);
+    boost::shared_ptr<MapRegistryEntry> &slot = map_registry[key];
+    if (!slot)
+      slot.reset(new MapRegistryEntry());
+    
+    entry = slot;
+  }
+  
+  boost::lock_guard<boost::mutex> g(entry->mutex);
+  boost::shared_ptr<MapPrivate> shared = entry->data.lock();
+  if (shared) {
+    d = shared;
+  } else {
+    if (!openShared())
+      return false;
+    
+    entry->data = d;
+  }
+  
+  // Link state is private to this instance
+  m_linkStates.assign(d->links.size(), MapLinkState());
+  m_loaded = true;
+  return true;
+}
+
+bool Map::openShared()
+{
   // Load the map
+  d.reset(new MapPrivate());
   if (!load()) {
     getLogger()->warning("Map loading has failed.");
     return false;
   }
   
-  // Link the map
-  if (!link()) {
-    getLogger()->warning("Map linking has failed.");
-    return false;
+  // Link the map unless a link graph for this exact map has already
+  // been computed and cached by a previous run
+  uint64_t hash = computeHash();
+  std::string cacheFilename = getLinkCacheFilename();
+  if (!loadLinkCache(cacheFilename, hash)) {
+    if (!link()) {
+      getLogger()->warning("Map linking has failed.");
+      return false;
+    }
+    
+    if (!saveLinkCache(cacheFilename, hash))
+      getLogger()->warning(format("Unable to save link cache to %s.") % cacheFilename);
   }
   
-  m_loaded = true;
+  buildFacePolygons();
+  buildAreaGraph();
+  
+  // The contents grid only depends on the BSP tree, so it is cached next
+  // to the link graph; maps too big for a grid are cheap to reject and
+  // are not cached
+  uint64_t contentsHash = computeContentsHash(hash);
+  std::string contentsFilename = getContentsCacheFilename();
+  if (!loadContentsCache(contentsFilename, contentsHash)) {
+    buildContentsGrid();
+    
+    if (d->hasContentsGrid && !saveContentsCache(contentsFilename, contentsHash))
+      getLogger()->warning(format("Unable to save contents cache to %s.") % contentsFilename);
+  }
+  
+  if (!loadVisibility())
+    getLogger()->warning("Map visibility data is corrupted, visibility culling is disabled.");
+  
+  if (!loadEntities())
+    getLogger()->warning("Map entities lump is corrupted, some entities will not be known.");
+  
   return true;
 }
 
 bool Map::load()
 {
-  // Attempt to load map from a PAK datafile
-  int length = 0;
+  // Attempt to load map from a PAK datafile; the whole PAK is mapped into
+  // memory and lumps are used in place, so no data is copied and multiple
+  // bot processes share the same page cache pages
   BOOST_FOREACH(std::string pak, m_paks) {
     int fh = ::open((m_context->getGameDir() + "/" + pak).c_str(), O_RDONLY);
-    if (fh != -1) {
-      // Parse PAK header
-      pak_header_t pakHeader;
-      length = read(fh, &pakHeader, sizeof(pak_header_t));
-      if (length == -1) {
-        close(fh);
-        getLogger()->error(format("Error reading from PAK %s!") % pak);
+    if (fh == -1)
+      continue;
+    
+    struct stat st;
+    if (fstat(fh, &st) == -1) {
+      close(fh);
+      getLogger()->error(format("Error reading from PAK %s!") % pak);
+      return false;
+    }
+    
+    size_t pakSize = st.st_size;
+    void *pakData = mmap(NULL, pakSize, PROT_READ, MAP_SHARED, fh, 0);
+    close(fh);
+    if (pakData == MAP_FAILED) {
+      getLogger()->error(format("Error mapping PAK %s!") % pak);
+      return false;
+    }
+    
+    // Parse PAK header
+    const char *base = static_cast<const char*>(pakData);
+    const pak_header_t *pakHeader = reinterpret_cast<const pak_header_t*>(base);
+    if (pakSize < sizeof(pak_header_t) || pakHeader->diroffset < 0 || pakHeader->dirsize < 0 ||
+        pakHeader->diroffset + pakHeader->dirsize > pakSize) {
+      munmap(pakData, pakSize);
+      getLogger()->warning(format("PAK %s is truncated or corrupted!") % pak);
+      continue;
+    }
+    
+    // Find our map among the entries in PAK VFS
+    int numDirs = pakHeader->dirsize / 0x40;
+    const pak_dir_entry_t *pakDirEntries = reinterpret_cast<const pak_dir_entry_t*>(base + pakHeader->diroffset);
+    for (int i = 0; i < numDirs; i++) {
+      if (m_name != pakDirEntries[i].filename)
+        continue;
+      
+      long bspSize = pakDirEntries[i].size;
+      if (pakDirEntries[i].offset < 0 || bspSize < (long) sizeof(bsp_header_t) ||
+          pakDirEntries[i].offset + bspSize > pakSize) {
+        munmap(pakData, pakSize);
+        getLogger()->warning(format("Map %s in PAK %s is truncated!") % m_name % pak);
         return false;
       }
       
-      // Load directory entries
-      int numDirs = pakHeader.dirsize / 0x40;
-      pak_dir_entry_t *pakDirEntries = (pak_dir_entry_t*) malloc(pakHeader.dirsize);
-      lseek(fh, pakHeader.diroffset, 0);
-      length = read(fh, pakDirEntries, pakHeader.dirsize);
-      if (length == -1) {
-        free(pakDirEntries);
-        close(fh);
-        getLogger()->error(format("Error reading from PAK %s!") % pak);
+      const char *bsp = base + pakDirEntries[i].offset;
+      const bsp_header_t *mapHeader = reinterpret_cast<const bsp_header_t*>(bsp);
+      if (mapHeader->ident != IDBSPHEADER || mapHeader->version != BSPVERSION) {
+        munmap(pakData, pakSize);
+        getLogger()->error(format("Unrecognized map version %d!") % mapHeader->version);
         return false;
       }
       
-      // Find our map among the entries in PAK VFS
-      for (int i = 0; i < numDirs; i++) {
-        if (m_name == pakDirEntries[i].filename) {
-          bsp_header_t mapHeader;
-          
-          lseek(fh, pakDirEntries[i].offset, 0);
-          read(fh, &mapHeader, sizeof(bsp_header_t));
-          if (mapHeader.ident != IDBSPHEADER || mapHeader.version != BSPVERSION) {
-            free(pakDirEntries);
-            close(fh);
-            getLogger()->error(format("Unrecognized map version %d!") % mapHeader.version);
-            return false;
-          }
-          
-          // Load map data
-          length = mapHeader.planes.size;
-          d->planeCount = length / sizeof(plane_t);
-          d->planes = (plane_t*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.planes.offset, 0);
-          read(fh, d->planes, length);
-          
-          length = mapHeader.vertices.size;
-          d->vertexCount = length / sizeof(vertex_t);
-          d->vertices = (vertex_t*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.vertices.offset, 0);
-          read(fh, d->vertices, length);
-          
-          length = mapHeader.nodes.size;
-          d->nodeCount = length / sizeof(node_t);
-          d->nodes = (node_t*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.nodes.offset, 0);
-          read(fh, d->nodes, length);
-          
-          length = mapHeader.faces.size;
-          d->faceCount = length / sizeof(face_t);
-          d->faces = (face_t*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.faces.offset, 0);
-          read(fh, d->faces, length);
-          
-          length = mapHeader.leaffaces.size;
-          d->leaffaceCount = length / sizeof(unsigned short);
-          d->leaffaces = (unsigned short*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.leaffaces.offset, 0);
-          read(fh, d->leaffaces, length);
-          
-          length = mapHeader.leafs.size;
-          d->leafCount = length / sizeof(leaf_t);
-          d->leafs = (leaf_t*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.leafs.offset, 0);
-          read(fh, d->leafs, length);
-          
-          length = mapHeader.edges.size;
-          d->edgeCount = length / sizeof(edge_t);
-          d->edges = (edge_t*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.edges.offset, 0);
-          read(fh, d->edges, length);
-          
-          length = mapHeader.surfedges.size;
-          d->surfedgeCount = length / sizeof(int);
-          d->surfedges = (int*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.surfedges.offset, 0);
-          read(fh, d->surfedges, length);
-          
-          length = mapHeader.models.size;
-          d->modelCount = length / sizeof(model_t);
-          d->models = (model_t*) malloc(length);
-          lseek(fh, pakDirEntries[i].offset + mapHeader.models.offset, 0);
-          read(fh, d->models, length);
-          
-          // Map loading is done
-          getLogger()->info(format("Found and loaded map %s from PAK %s.") % m_name % pak);
-          free(pakDirEntries);
-          close(fh);
-          return true;
-        }
+      // Setup views for map data
+      if (!mapLump(bsp, bspSize, mapHeader->planes, &d->planes) ||
+          !mapLump(bsp, bspSize, mapHeader->vertices, &d->vertices) ||
+          !mapLump(bsp, bspSize, mapHeader->nodes, &d->nodes) ||
+          !mapLump(bsp, bspSize, mapHeader->faces, &d->faces) ||
+          !mapLump(bsp, bspSize, mapHeader->leaffaces, &d->leaffaces) ||
+          !mapLump(bsp, bspSize, mapHeader->leafs, &d->leafs) ||
+          !mapLump(bsp, bspSize, mapHeader->leafbrushes, &d->leafbrushes) ||
+          !mapLump(bsp, bspSize, mapHeader->brushes, &d->brushes) ||
+          !mapLump(bsp, bspSize, mapHeader->brushsides, &d->brushsides) ||
+          !mapLump(bsp, bspSize, mapHeader->edges, &d->edges) ||
+          !mapLump(bsp, bspSize, mapHeader->surfedges, &d->surfedges) ||
+          !mapLump(bsp, bspSize, mapHeader->models, &d->models) ||
+          !mapLump(bsp, bspSize, mapHeader->areas, &d->areas) ||
+          !mapLump(bsp, bspSize, mapHeader->areaportals, &d->areaportals) ||
+          !mapLump(bsp, bspSize, mapHeader->vislist, &d->vislist) ||
+          !mapLump(bsp, bspSize, mapHeader->entities, &d->entityText)) {
+        munmap(pakData, pakSize);
+        getLogger()->warning(format("Map %s in PAK %s contains a corrupted lump!") % m_name % pak);
+        return false;
       }
       
-      close(fh);
+      // We are going to walk all of the map data during linking, so ask
+      // the kernel to start reading it in
+      long pageSize = sysconf(_SC_PAGESIZE);
+      size_t pageOffset = (bsp - base) & ~(pageSize - 1);
+      madvise(static_cast<char*>(pakData) + pageOffset, (bsp - base) - pageOffset + bspSize, MADV_WILLNEED);
+      
+      // Map loading is done
+      getLogger()->info(format("Found and mapped map %s from PAK %s.") % m_name % pak);
+      d->pak = pakData;
+      d->pakSize = pakSize;
+      return true;
     }
+    
+    munmap(pakData, pakSize);
   }
   
   getLogger()->warning(format("Map %s cannot be found!") % m_name);
@@ -256,59 +907,80 @@ MapLink *Map::getLink(int linkId) const
   return d->links[linkId];
 }
 
+MapLinkState *Map::getLinkState(const MapLink *link)
+{
+  if (link == NULL || link->getIndex() < 0 || link->getIndex() >= m_linkStates.size())
+    return NULL;
+  
+  return &m_linkStates[link->getIndex()];
+}
+
+int Map::getFaceCount() const
+{
+  return d->xfaces.size();
+}
+
+MapFace *Map::getFace(int faceId) const
+{
+  if (faceId < 0 || faceId >= d->xfaces.size())
+    return NULL;
+  
+  return d->xfaces[faceId];
+}
+
+// XXX use eigen2
+float yawFromVect(vec3_t delta) {
+	if(delta[0]==0) {
+		if(delta[1]>=0) {
+			return M_PI/2;
+		} else {
+			return 3*M_PI/2;
+		}
+	} else {
+		if(delta[0]>=0) {
+			if(delta[1]>=0) {
+				return (float)atan(delta[1]/delta[0]);
+			} else {
+				return 2*M_PI+(float)atan(delta[1]/delta[0]);
+			}
+		} else {
+			return M_PI+(float)atan(delta[1]/delta[0]);
+		}
+	}
+}
+
+// XXX use eigen2
+float pitchFromVect(vec3_t delta) {
+	float delta2;
+
+	delta2=sqrt(delta[0]*delta[0]+delta[1]*delta[1]);
+	if(delta2==0) {
+		if(delta[2]>=0) {
+			return M_PI/2;
+		} else {
+			return 3*M_PI/2;
+		}
+	} else {
+		if(delta2>=0) {
+			if(delta[2]>=0) {
+				return (float)atan(delta[2]/delta2);
+			} else {
+				return 2*M_PI+(float)atan(delta[2]/delta2);
+			}
+		} else {
+			return M_PI+(float)atan(delta[2]/delta2);
+		}
+	}
+}
+
 // XXX use eigen2
-float yawFromVect(vec3_t delta) {
-	if(delta[0]==0) {
-		if(delta[1]>=0) {
-			return M_PI/2;
-		} else {
-			return 3*M_PI/2;
-		}
-	} else {
-		if(delta[0]>=0) {
-			if(delta[1]>=0) {
-				return (float)atan(delta[1]/delta[0]);
-			} else {
-				return 2*M_PI+(float)atan(delta[1]/delta[0]);
-			}
-		} else {
-			return M_PI+(float)atan(delta[1]/delta[0]);
-		}
-	}
-}
-
-// XXX use eigen2
-float pitchFromVect(vec3_t delta) {
-	float delta2;
-
-	delta2=sqrt(delta[0]*delta[0]+delta[1]*delta[1]);
-	if(delta2==0) {
-		if(delta[2]>=0) {
-			return M_PI/2;
-		} else {
-			return 3*M_PI/2;
-		}
-	} else {
-		if(delta2>=0) {
-			if(delta[2]>=0) {
-				return (float)atan(delta[2]/delta2);
-			} else {
-				return 2*M_PI+(float)atan(delta[2]/delta2);
-			}
-		} else {
-			return M_PI+(float)atan(delta[2]/delta2);
-		}
-	}
-}
-
-// XXX use eigen2
-float distFromVect(vec3_t u,vec3_t v) {
-	float x,y,z;
-
-	x=v[0]-u[0];
-	y=v[1]-u[1];
-	z=v[2]-u[2];
-	return (float)sqrt(x*x+y*y+z*z);
+float distFromVect(vec3_t u,vec3_t v) {
+	float x,y,z;
+
+	x=v[0]-u[0];
+	y=v[1]-u[1];
+	z=v[2]-u[2];
+	return (float)sqrt(x*x+y*y+z*z);
 }
 
 // Edge comparison function
@@ -329,35 +1001,32 @@ private:
   bool m_key1;
 };
 
-MapLink *Map::createLink(int face, int n, int k)
+void Map::createLink(int face, int n, int k, std::vector<MapLinkCandidate> *links)
 {
   int faceId = (int) d->edgefaces[n].face[face];
   if (faceId < 0)
-    return NULL;
+    return;
   
-  // Create a new map link
-  MapLink *link = new MapLink(
-    d->xfaces[faceId],
-    Vector3f(
-      (d->vertices[d->edges[k].v[0]].origin[0] + d->vertices[d->edges[k].v[1]].origin[0]) / 2,
-      (d->vertices[d->edges[k].v[0]].origin[1] + d->vertices[d->edges[k].v[1]].origin[1]) / 2,
-      (d->vertices[d->edges[k].v[0]].origin[2] + d->vertices[d->edges[k].v[1]].origin[2]) / 2
-    )
+  // Remember the link, it is created when all faces have been linked
+  MapLinkCandidate link;
+  link.face = faceId;
+  link.origin = Vector3f(
+    (d->vertices[d->edges[k].v[0]].origin[0] + d->vertices[d->edges[k].v[1]].origin[0]) / 2,
+    (d->vertices[d->edges[k].v[0]].origin[1] + d->vertices[d->edges[k].v[1]].origin[1]) / 2,
+    (d->vertices[d->edges[k].v[0]].origin[2] + d->vertices[d->edges[k].v[1]].origin[2]) / 2
   );
-  
-  d->links.push_back(link);
-  return link;
+  links->push_back(link);
 }
 
 bool Map::link()
 {
   // Initialize structures
   d->edgefriends = (int*) malloc(65536 * sizeof(int));
-  d->edgefaces = (edgeface_t*) malloc(d->edgeCount * sizeof(edgeface_t));
-  d->xedges = (xedge_t*) malloc(d->edgeCount * sizeof(xedge_t));
-  d->sortededges.resize(d->edgeCount);
+  d->edgefaces = (edgeface_t*) malloc(d->edges.size() * sizeof(edgeface_t));
+  d->xedges = (xedge_t*) malloc(d->edges.size() * sizeof(xedge_t));
+  d->sortededges.resize(d->edges.size());
   
-  for (int i = 0; i < d->edgeCount; i++) {
+  for (int i = 0; i < d->edges.size(); i++) {
     vec3_t u;
     
     d->edgefaces[i].face[0] = -1;
@@ -397,7 +1066,7 @@ bool Map::link()
   }
   
   // Sort edges
-  edge_compare compare_fun(d);
+  edge_compare compare_fun(d.get());
   std::sort(d->sortededges.begin(), d->sortededges.end(), compare_fun);
   
   // Find friends
@@ -405,7 +1074,7 @@ bool Map::link()
     return false;
   
   // Now come the faces
-  for (int i = 0; i < d->faceCount; i++) {
+  for (int i = 0; i < d->faces.size(); i++) {
     MapFace *face = new MapFace(d->xfaces.size());
     long type = 0;
     
@@ -454,68 +1123,35 @@ bool Map::link()
     d->xfaces.push_back(face);
   }
   
-  // Now finally create the links
-  for (int m = 0; m < d->modelCount; m++) {
+  // Now finally create the links; link discovery for each face only reads
+  // map data, so faces are processed on all cores and the results merged
+  // in the same order as a serial pass would produce them
+  std::vector<int> linkFaces;
+  for (int m = 0; m < d->models.size(); m++) {
     for (int i = 0; i < d->models[m].numfaces; i++) {
-      if (d->xfaces[i]->getType() & 0x00000001) {
-        for (int j = 0; j < d->faces[i].numedges; j++) {
-          int k = d->surfedges[j + d->faces[i].firstedge];
-          if (k < 0) {
-            k = -k;
-          }
-          
-          if (d->edgefaces[k].face[0] == i) {
-            if (d->edgefaces[k].face[1] != -1) {
-              if (d->xfaces[d->edgefaces[k].face[1]]->getType() & 0x00000001) {
-                // Create a new link
-                d->xfaces[i]->addLink(createLink(1, k, k));
-              } else if (d->xfaces[d->edgefaces[k].face[1]]->getType() & 0x00000002) {
-                if (!checkWall(d->edgefaces[k].face[1], i, k)) {
-                  return false;
-                }
-              }
-            }
-          } else if (d->edgefaces[k].face[1] == i) {
-            if (d->edgefaces[k].face[0] != -1) {
-              if (d->xfaces[d->edgefaces[k].face[0]]->getType() & 0x00000001) {
-                // Create a new link
-                d->xfaces[i]->addLink(createLink(0, k, k));
-              } else if (d->xfaces[d->edgefaces[k].face[0]]->getType() & 0x00000002) {
-                if (!checkWall(d->edgefaces[k].face[0], i, k)) {
-                  return false;
-                }
-              }
-            }
-          } else {
-            getLogger()->warning("Neither face links back to original.");
-            return false;
-          }
-          
-          for (int l = 0; l < d->xedges[k].numfriends; l++) {
-            int n = d->edgefriends[d->xedges[k].firstfriend + l];
-            
-            if (d->edgefaces[n].face[0] != -1) {
-              if (d->xfaces[d->edgefaces[n].face[0]]->getType() & 0x00000001) {
-                // Change n to k
-                d->xfaces[i]->addLink(createLink(0, n, k));
-              } else if (d->xfaces[d->edgefaces[n].face[0]]->getType() & 0x00000002) {
-                if (!checkWall(d->edgefaces[n].face[0], i, n)) {
-                  return false;
-                }
-              }
-            } else if (d->edgefaces[n].face[1] != -1) {
-              if (d->xfaces[d->edgefaces[n].face[1]]->getType() & 0x00000001) {
-                // Change n to k
-                d->xfaces[i]->addLink(createLink(1, n, k));
-              } else if (d->xfaces[d->edgefaces[n].face[1]]->getType() & 0x00000002) {
-                if (!checkWall(d->edgefaces[n].face[1], i, n)) {
-                  return false;
-                }
-              }
-            }
-          }
-        }
-      }
+      if (d->xfaces[i]->getType() & 0x00000001)
+        linkFaces.push_back(i);
+    }
+  }
+  
+  int threads = std::max(1, (int) boost::thread::hardware_concurrency());
+  std::vector<std::vector<MapLinkCandidate> > candidates(linkFaces.size());
+  std::vector<char> results(threads, true);
+  boost::thread_group workers;
+  for (int t = 1; t < threads; t++) {
+    workers.create_thread(boost::bind(&Map::linkWorker, this, &linkFaces, t, threads, &candidates, &results[t]));
+  }
+  linkWorker(&linkFaces, 0, threads, &candidates, &results[0]);
+  workers.join_all();
+  
+  if (std::find(results.begin(), results.end(), false) != results.end())
+    return false;
+  
+  for (size_t j = 0; j < linkFaces.size(); j++) {
+    BOOST_FOREACH(const MapLinkCandidate &c, candidates[j]) {
+      MapLink *link = new MapLink(d->links.size(), d->xfaces[c.face], c.origin);
+      d->links.push_back(link);
+      d->xfaces[linkFaces[j]]->addLink(link);
     }
   }
   
@@ -525,28 +1161,114 @@ bool Map::link()
   return true;
 }
 
-bool Map::findFriends()
+void Map::linkWorker(const std::vector<int> *faces, int thread, int threads,
+                     std::vector<std::vector<MapLinkCandidate> > *candidates, char *result)
 {
-  bool flag = true;
-  int first, last, edge, edge2;
-  unsigned short key = 65535;
-  
-  d->edgefriendCount = 0;
-  
-  for (int i = 0; i < d->edgeCount; i++) {
-    flag = true;
-    edge = d->sortededges[i];
-    d->xedges[edge].firstfriend = d->edgefriendCount;
-    d->xedges[edge].numfriends = 0;
+  // Faces are dealt out to threads in small interleaved blocks to balance
+  // the work between them
+  const int block = 64;
+  for (size_t start = thread * block; start < faces->size(); start += threads * block) {
+    for (size_t j = start; j < std::min(faces->size(), start + block); j++) {
+      if (!linkFace((*faces)[j], &(*candidates)[j])) {
+        *result = false;
+        return;
+      }
+    }
+  }
+}
+
+bool Map::linkFace(int i, std::vector<MapLinkCandidate> *links)
+{
+  for (int j = 0; j < d->faces[i].numedges; j++) {
+    int k = d->surfedges[j + d->faces[i].firstedge];
+    if (k < 0) {
+      k = -k;
+    }
+    
+    if (d->edgefaces[k].face[0] == i) {
+      if (d->edgefaces[k].face[1] != -1) {
+        if (d->xfaces[d->edgefaces[k].face[1]]->getType() & 0x00000001) {
+          // Create a new link
+          createLink(1, k, k, links);
+        } else if (d->xfaces[d->edgefaces[k].face[1]]->getType() & 0x00000002) {
+          if (!checkWall(d->edgefaces[k].face[1], i, k, links)) {
+            return false;
+          }
+        }
+      }
+    } else if (d->edgefaces[k].face[1] == i) {
+      if (d->edgefaces[k].face[0] != -1) {
+        if (d->xfaces[d->edgefaces[k].face[0]]->getType() & 0x00000001) {
+          // Create a new link
+          createLink(0, k, k, links);
+        } else if (d->xfaces[d->edgefaces[k].face[0]]->getType() & 0x00000002) {
+          if (!checkWall(d->edgefaces[k].face[0], i, k, links)) {
+            return false;
+          }
+        }
+      }
+    } else {
+      getLogger()->warning("Neither face links back to original.");
+      return false;
+    }
+    
+    for (int l = 0; l < d->xedges[k].numfriends; l++) {
+      int n = d->edgefriends[d->xedges[k].firstfriend + l];
+      
+      if (d->edgefaces[n].face[0] != -1) {
+        if (d->xfaces[d->edgefaces[n].face[0]]->getType() & 0x00000001) {
+          // Change n to k
+          createLink(0, n, k, links);
+        } else if (d->xfaces[d->edgefaces[n].face[0]]->getType() & 0x00000002) {
+          if (!checkWall(d->edgefaces[n].face[0], i, n, links)) {
+            return false;
+          }
+        }
+      } else if (d->edgefaces[n].face[1] != -1) {
+        if (d->xfaces[d->edgefaces[n].face[1]]->getType() & 0x00000001) {
+          // Change n to k
+          createLink(1, n, k, links);
+        } else if (d->xfaces[d->edgefaces[n].face[1]]->getType() & 0x00000002) {
+          if (!checkWall(d->edgefaces[n].face[1], i, n, links)) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+  
+  return true;
+}
+
+bool Map::findFriends()
+{
+  bool flag = true;
+  int first, last, edge, edge2;
+  unsigned short key = 65535;
+  
+  d->edgefriendCount = 0;
+  
+  // Index of the first sorted edge with each key; groups with special keys
+  // are sorted over one extra edge, which may move the first edge of the
+  // next group ahead, so entries for keys in such ranges are updated
+  std::vector<int> firstIndex(65536, -1);
+  for (int i = d->edges.size() - 1; i >= 0; i--) {
+    firstIndex[d->xedges[d->sortededges[i]].key] = i;
+  }
+  
+  for (int i = 0; i < d->edges.size(); i++) {
+    flag = true;
+    edge = d->sortededges[i];
+    d->xedges[edge].firstfriend = d->edgefriendCount;
+    d->xedges[edge].numfriends = 0;
     
     if (d->xedges[edge].key != key) {
       key = d->xedges[edge].key;
       
-      for (first = 0; d->xedges[d->sortededges[first]].key != key; first++) {
-      }
+      first = firstIndex[key];
       
       for (last = first; d->xedges[d->sortededges[last]].key == key; last++) {
-        if (last == d->edgeCount - 1) {
+        if (last == d->edges.size() - 1) {
           break;
         }
       }
@@ -555,8 +1277,13 @@ bool Map::findFriends()
         flag = false;
         
         // Sort by other key
-        edge_compare compare_fun(d, false);
+        edge_compare compare_fun(d.get(), false);
         std::sort(d->sortededges.begin() + first, d->sortededges.begin() + last + 1, compare_fun);
+        for (int j = last; j >= first; j--) {
+          unsigned short moved = d->xedges[d->sortededges[j]].key;
+          if (firstIndex[moved] >= first)
+            firstIndex[moved] = j;
+        }
         
         if (!findFriends2(first, last)) {
           return false;
@@ -606,8 +1333,8 @@ bool Map::findFriends2(int start, int end)
     if (d->xedges[edge].key2 != key2) {
       key2 = d->xedges[edge].key2;
       
-      for (first = start; d->xedges[d->sortededges[first]].key2 != key2; first++) {
-      }
+      // Edges are sorted by the secondary key, so the group starts right here
+      first = i;
       
       for (last = first; d->xedges[d->sortededges[last]].key2 == key2; last++) {
         if (last == end - 1) {
@@ -640,59 +1367,59 @@ bool Map::findFriends2(int start, int end)
 }
 
 bool Map::colinear(int m, int n)
-{
-  vec3_t u;
-  unsigned char yaw, pitch;
-  unsigned short key;
-
-  u[0] = d->vertices[d->edges[n].v[0]].origin[0] - d->vertices[d->edges[m].v[0]].origin[0];
-  u[1] = d->vertices[d->edges[n].v[0]].origin[1] - d->vertices[d->edges[m].v[0]].origin[1];
+{
+  vec3_t u;
+  unsigned char yaw, pitch;
+  unsigned short key;
+
+  u[0] = d->vertices[d->edges[n].v[0]].origin[0] - d->vertices[d->edges[m].v[0]].origin[0];
+  u[1] = d->vertices[d->edges[n].v[0]].origin[1] - d->vertices[d->edges[m].v[0]].origin[1];
   u[2] = d->vertices[d->edges[n].v[0]].origin[2] - d->vertices[d->edges[m].v[0]].origin[2];
-  
-  pitch = (unsigned char) (pitchFromVect(u) * 256.0/M_PI);
-  yaw = (unsigned char) (yawFromVect(u) * 256.0/M_PI);
-  key = yaw + (pitch << 8);
-  return (key == d->xedges[m].key && key == d->xedges[n].key);
+  
+  pitch = (unsigned char) (pitchFromVect(u) * 256.0/M_PI);
+  yaw = (unsigned char) (yawFromVect(u) * 256.0/M_PI);
+  key = yaw + (pitch << 8);
+  return (key == d->xedges[m].key && key == d->xedges[n].key);
 }
 
 bool Map::edgeOverlap(int n, int m)
-{
-  bool p,q;
-  float x1, x2, x3, x4, y1, y2, y3, y4, temp;
-
-  x1 = d->vertices[d->edges[n].v[0]].origin[0];
-  x2 = d->vertices[d->edges[n].v[1]].origin[0];
-  x3=  d->vertices[d->edges[m].v[0]].origin[0];
-  x4 = d->vertices[d->edges[m].v[1]].origin[0];
-  y1 = d->vertices[d->edges[n].v[0]].origin[1];
-  y2 = d->vertices[d->edges[n].v[1]].origin[1];
-  y3 = d->vertices[d->edges[m].v[0]].origin[1];
-  y4 = d->vertices[d->edges[m].v[1]].origin[1];
-
-  if (x1 > x2) { temp = x1; x1 = x2; x2 = temp; }
-  if (x3 > x4) { temp = x3; x3 = x4; x4 = temp; }
-  if (y1 > y2) { temp = y1; y1 = y2; y2 = temp; }
-  if (y3 > y4) { temp = y3; y3 = y4; y4 = temp; }
-
-  p = ((x1<=x3 && x3<x2) || (x3<=x1 && x1<x4) || (x1==x2 && (x1==x3 || x1==x4)) || (x3==x4 && (x3==x1 || x3==x2)));
-  q = ((y1<=y3 && y3<y2) || (y3<=y1 && y1<y4) || (y1==y2 && (y1==y3 || y1==y4)) || (y3==y4 && (y3==y1 || y3==y2)));
-
-  return (p && q);
+{
+  bool p,q;
+  float x1, x2, x3, x4, y1, y2, y3, y4, temp;
+
+  x1 = d->vertices[d->edges[n].v[0]].origin[0];
+  x2 = d->vertices[d->edges[n].v[1]].origin[0];
+  x3=  d->vertices[d->edges[m].v[0]].origin[0];
+  x4 = d->vertices[d->edges[m].v[1]].origin[0];
+  y1 = d->vertices[d->edges[n].v[0]].origin[1];
+  y2 = d->vertices[d->edges[n].v[1]].origin[1];
+  y3 = d->vertices[d->edges[m].v[0]].origin[1];
+  y4 = d->vertices[d->edges[m].v[1]].origin[1];
+
+  if (x1 > x2) { temp = x1; x1 = x2; x2 = temp; }
+  if (x3 > x4) { temp = x3; x3 = x4; x4 = temp; }
+  if (y1 > y2) { temp = y1; y1 = y2; y2 = temp; }
+  if (y3 > y4) { temp = y3; y3 = y4; y4 = temp; }
+
+  p = ((x1<=x3 && x3<x2) || (x3<=x1 && x1<x4) || (x1==x2 && (x1==x3 || x1==x4)) || (x3==x4 && (x3==x1 || x3==x2)));
+  q = ((y1<=y3 && y3<y2) || (y3<=y1 && y1<y4) || (y1==y2 && (y1==y3 || y1==y4)) || (y3==y4 && (y3==y1 || y3==y2)));
+
+  return (p && q);
 }
 
 float Map::heightBetween(int n, int m)
-{
-  float z1, z2, z3, z4;
-
-  z1 = d->vertices[d->edges[n].v[0]].origin[2];
-  z2 = d->vertices[d->edges[n].v[1]].origin[2];
-  z3 = d->vertices[d->edges[m].v[0]].origin[2];
+{
+  float z1, z2, z3, z4;
+
+  z1 = d->vertices[d->edges[n].v[0]].origin[2];
+  z2 = d->vertices[d->edges[n].v[1]].origin[2];
+  z3 = d->vertices[d->edges[m].v[0]].origin[2];
   z4 = d->vertices[d->edges[m].v[1]].origin[2];
-  
-  return ((z3 + z4 - z1 - z2) / 2);
+  
+  return ((z3 + z4 - z1 - z2) / 2);
 }
 
-bool Map::checkWall(int wall, int face, int edge)
+bool Map::checkWall(int wall, int face, int edge, std::vector<MapLinkCandidate> *links)
 {
   for (int j = 0; j < d->faces[wall].numedges; j++) {
     int k = d->surfedges[j + d->faces[wall].firstedge];
@@ -706,14 +1433,14 @@ bool Map::checkWall(int wall, int face, int edge)
         if (d->edgefaces[k].face[1] != -1) {
           if (d->xfaces[d->edgefaces[k].face[1]]->getType() & 0x00000001 && d->edgefaces[k].face[1] != face) {
             // Change k to edge
-            d->xfaces[face]->addLink(createLink(1, k, edge));
+            createLink(1, k, edge, links);
           }
         }
       } else if (d->edgefaces[k].face[1] == wall) {
         if (d->edgefaces[k].face[0] != -1) {
           if (d->xfaces[d->edgefaces[k].face[0]]->getType() & 0x00000001 && d->edgefaces[k].face[0] != face) {
             // Change k to edge
-            d->xfaces[face]->addLink(createLink(0, k, edge));
+            createLink(0, k, edge, links);
           }
         }
       } else {
@@ -731,12 +1458,12 @@ bool Map::checkWall(int wall, int face, int edge)
         if (d->edgefaces[n].face[0] != -1) {
           if (d->xfaces[d->edgefaces[n].face[0]]->getType() & 0x00000001) {
             // Change n to edge
-            d->xfaces[face]->addLink(createLink(0, n, edge));
+            createLink(0, n, edge, links);
           }
         } else if (d->edgefaces[n].face[1] != -1) {
           if (d->xfaces[d->edgefaces[n].face[1]]->getType() & 0x00000001) {
             // Change k to edge
-            d->xfaces[face]->addLink(createLink(1, k, edge));
+            createLink(1, k, edge, links);
           }
         }
       }
@@ -746,13 +1473,291 @@ bool Map::checkWall(int wall, int face, int edge)
   return true;
 }
 
+uint64_t Map::computeHash() const
+{
+  uint64_t hash = 14695981039346656037ULL;
+  hash = fnvHash(hash, &link_cache_version, sizeof(link_cache_version));
+  hash = fnvHash(hash, d->planes.data(), d->planes.size() * sizeof(plane_t));
+  hash = fnvHash(hash, d->vertices.data(), d->vertices.size() * sizeof(vertex_t));
+  hash = fnvHash(hash, d->faces.data(), d->faces.size() * sizeof(face_t));
+  hash = fnvHash(hash, d->edges.data(), d->edges.size() * sizeof(edge_t));
+  hash = fnvHash(hash, d->surfedges.data(), d->surfedges.size() * sizeof(int));
+  hash = fnvHash(hash, d->models.data(), d->models.size() * sizeof(model_t));
+  return hash;
+}
+
+std::string Map::getLinkCacheFilename() const
+{
+  std::string mn = std::string(basename(m_name.c_str()));
+  mn = mn.substr(0, mn.find("."));
+  return m_context->getDataDir() + "/links-" + mn + ".hmc";
+}
+
+bool Map::loadLinkCache(const std::string &filename, uint64_t hash)
+{
+  std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+  if (!in.is_open())
+    return false;
+  
+  // Verify that the cache has been made for this map
+  link_cache_header_t header;
+  if (!readRaw(in, &header))
+    return false;
+  
+  if (header.magic != link_cache_magic || header.version != link_cache_version || header.hash != hash ||
+      header.faceCount != d->faces.size() || header.edgeCount != d->edges.size() ||
+      header.edgefriendCount >= 65536) {
+    getLogger()->info(format("Link cache %s is stale, relinking the map.") % filename);
+    return false;
+  }
+  
+  // Read everything into temporary storage first, so a truncated cache
+  // leaves us in a state where we can still link the map ourselves
+  std::vector<link_cache_face_t> faces(header.faceCount);
+  std::vector<link_cache_link_t> links(header.linkCount);
+  std::vector<uint32_t> faceLinks;
+  std::vector<xedge_t> xedges(header.edgeCount);
+  std::vector<edgeface_t> edgefaces(header.edgeCount);
+  std::vector<int> edgefriends(header.edgefriendCount);
+  
+  if (header.faceCount && !readRaw(in, &faces[0], faces.size()))
+    return false;
+  if (header.linkCount && !readRaw(in, &links[0], links.size()))
+    return false;
+  if (header.edgeCount && (!readRaw(in, &xedges[0], xedges.size()) || !readRaw(in, &edgefaces[0], edgefaces.size())))
+    return false;
+  if (header.edgefriendCount && !readRaw(in, &edgefriends[0], edgefriends.size()))
+    return false;
+  
+  size_t faceLinkCount = 0;
+  for (size_t i = 0; i < faces.size(); i++) {
+    faceLinkCount += faces[i].linkCount;
+  }
+  
+  faceLinks.resize(faceLinkCount);
+  if (faceLinkCount && !readRaw(in, &faceLinks[0], faceLinks.size()))
+    return false;
+  
+  for (size_t i = 0; i < links.size(); i++) {
+    if (links[i].face < 0 || links[i].face >= (int32_t) faces.size())
+      return false;
+  }
+  
+  for (size_t i = 0; i < faceLinks.size(); i++) {
+    if (faceLinks[i] >= links.size())
+      return false;
+  }
+  
+  // Cache is valid, rebuild the link graph
+  for (size_t i = 0; i < faces.size(); i++) {
+    MapFace *face = new MapFace(i);
+    face->setType(faces[i].type);
+    face->setOrigin(Vector3f(faces[i].origin[0], faces[i].origin[1], faces[i].origin[2]));
+    d->xfaces.push_back(face);
+  }
+  
+  for (size_t i = 0; i < links.size(); i++) {
+    d->links.push_back(new MapLink(
+      i,
+      d->xfaces[links[i].face],
+      Vector3f(links[i].origin[0], links[i].origin[1], links[i].origin[2])
+    ));
+  }
+  
+  size_t k = 0;
+  for (size_t i = 0; i < faces.size(); i++) {
+    for (uint32_t j = 0; j < faces[i].linkCount; j++) {
+      d->xfaces[i]->addLink(d->links[faceLinks[k++]]);
+    }
+  }
+  
+  d->xedges = (xedge_t*) malloc(header.edgeCount * sizeof(xedge_t));
+  d->edgefaces = (edgeface_t*) malloc(header.edgeCount * sizeof(edgeface_t));
+  d->edgefriends = (int*) malloc(65536 * sizeof(int));
+  d->edgefriendCount = header.edgefriendCount;
+  std::copy(xedges.begin(), xedges.end(), d->xedges);
+  std::copy(edgefaces.begin(), edgefaces.end(), d->edgefaces);
+  std::copy(edgefriends.begin(), edgefriends.end(), d->edgefriends);
+  
+  getLogger()->info(format("Loaded %d links from link cache %s.") % d->links.size() % filename);
+  return true;
+}
+
+bool Map::saveLinkCache(const std::string &filename, uint64_t hash) const
+{
+  // Links are referenced by their position in the global link list
+  boost::unordered_map<MapLink*, uint32_t> linkIds;
+  for (size_t i = 0; i < d->links.size(); i++) {
+    linkIds[d->links[i]] = i;
+  }
+  
+  std::string tmpFilename;
+  if (!createCacheTempFile(filename, &tmpFilename))
+    return false;
+  
+  std::ofstream out(tmpFilename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    unlink(tmpFilename.c_str());
+    return false;
+  }
+  
+  link_cache_header_t header;
+  header.magic = link_cache_magic;
+  header.version = link_cache_version;
+  header.hash = hash;
+  header.faceCount = d->xfaces.size();
+  header.edgeCount = d->edges.size();
+  header.linkCount = d->links.size();
+  header.edgefriendCount = d->edgefriendCount;
+  writeRaw(out, &header);
+  
+  BOOST_FOREACH(MapFace *face, d->xfaces) {
+    link_cache_face_t f;
+    Vector3f origin = face->getOrigin();
+    f.type = face->getType();
+    f.origin[0] = origin[0];
+    f.origin[1] = origin[1];
+    f.origin[2] = origin[2];
+    f.linkCount = face->links().size();
+    writeRaw(out, &f);
+  }
+  
+  BOOST_FOREACH(MapLink *link, d->links) {
+    link_cache_link_t l;
+    Vector3f origin = link->getOrigin();
+    l.face = link->getFace()->getIndex();
+    l.origin[0] = origin[0];
+    l.origin[1] = origin[1];
+    l.origin[2] = origin[2];
+    writeRaw(out, &l);
+  }
+  
+  writeRaw(out, d->xedges, d->edges.size());
+  writeRaw(out, d->edgefaces, d->edges.size());
+  writeRaw(out, d->edgefriends, d->edgefriendCount);
+  
+  BOOST_FOREACH(MapFace *face, d->xfaces) {
+    BOOST_FOREACH(MapLink *link, face->links()) {
+      uint32_t id = linkIds[link];
+      writeRaw(out, &id);
+    }
+  }
+  
+  out.close();
+  if (out.fail() || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    unlink(tmpFilename.c_str());
+    return false;
+  }
+  
+  getLogger()->info(format("Saved link cache to %s.") % filename);
+  return true;
+}
+
+uint64_t Map::computeContentsHash(uint64_t hash) const
+{
+  hash = fnvHash(hash, &contents_cache_version, sizeof(contents_cache_version));
+  hash = fnvHash(hash, d->nodes.data(), d->nodes.size() * sizeof(node_t));
+  hash = fnvHash(hash, d->leafs.data(), d->leafs.size() * sizeof(leaf_t));
+  return hash;
+}
+
+std::string Map::getContentsCacheFilename() const
+{
+  std::string mn = std::string(basename(m_name.c_str()));
+  mn = mn.substr(0, mn.find("."));
+  return m_context->getDataDir() + "/contents-" + mn + ".hmc";
+}
+
+bool Map::loadContentsCache(const std::string &filename, uint64_t hash)
+{
+  std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+  if (!in.is_open())
+    return false;
+  
+  // Verify that the cache has been made for this map
+  contents_cache_header_t header;
+  if (!readRaw(in, &header))
+    return false;
+  
+  if (header.magic != contents_cache_magic || header.version != contents_cache_version || header.hash != hash ||
+      header.bricks[0] < 1 || header.bricks[1] < 1 || header.bricks[2] < 1 ||
+      (uint64_t) header.bricks[0] * header.bricks[1] * header.bricks[2] != header.brickCount ||
+      header.cellCount > contents_max_cells || header.cellCount % contents_brick_cells != 0) {
+    getLogger()->info(format("Contents cache %s is stale, rebuilding the contents grid.") % filename);
+    return false;
+  }
+  
+  std::vector<uint32_t> brickTable(header.brickCount);
+  std::vector<uint16_t> cells(header.cellCount);
+  if (!readRaw(in, &brickTable[0], brickTable.size()))
+    return false;
+  if (header.cellCount && !readRaw(in, &cells[0], cells.size()))
+    return false;
+  
+  // Non-uniform bricks must point into the cell storage
+  for (size_t i = 0; i < brickTable.size(); i++) {
+    if (!(brickTable[i] & contents_uniform) && brickTable[i] >= header.cellCount / contents_brick_cells)
+      return false;
+  }
+  
+  for (int i = 0; i < 3; i++) {
+    d->gridOrigin[i] = header.origin[i];
+    d->gridBricks[i] = header.bricks[i];
+  }
+  
+  d->gridBrickTable.swap(brickTable);
+  d->gridCells.swap(cells);
+  d->hasContentsGrid = true;
+  
+  getLogger()->info(format("Loaded contents grid with %d cells from contents cache %s.") %
+    (d->gridBrickTable.size() * contents_brick_cells) % filename);
+  return true;
+}
+
+bool Map::saveContentsCache(const std::string &filename, uint64_t hash) const
+{
+  std::string tmpFilename;
+  if (!createCacheTempFile(filename, &tmpFilename))
+    return false;
+  
+  std::ofstream out(tmpFilename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    unlink(tmpFilename.c_str());
+    return false;
+  }
+  
+  contents_cache_header_t header;
+  header.magic = contents_cache_magic;
+  header.version = contents_cache_version;
+  header.hash = hash;
+  for (int i = 0; i < 3; i++) {
+    header.origin[i] = d->gridOrigin[i];
+    header.bricks[i] = d->gridBricks[i];
+  }
+  header.brickCount = d->gridBrickTable.size();
+  header.cellCount = d->gridCells.size();
+  writeRaw(out, &header);
+  writeRaw(out, &d->gridBrickTable[0], d->gridBrickTable.size());
+  if (!d->gridCells.empty())
+    writeRaw(out, &d->gridCells[0], d->gridCells.size());
+  
+  out.close();
+  if (out.fail() || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    unlink(tmpFilename.c_str());
+    return false;
+  }
+  
+  getLogger()->info(format("Saved contents cache to %s.") % filename);
+  return true;
+}
+
 int Map::findLeafId(const Vector3f &pos) const
 {
   // Start at the map root node
   int nextNode = d->models[0].rootnode;
   
   while (nextNode >= 0) {
-    plane_t *plane = &(d->planes[d->nodes[nextNode].planenum]);
+    const plane_t *plane = &(d->planes[d->nodes[nextNode].planenum]);
     
     // Decide where to go next in the BSP tree
     if (plane->type == 0) {
@@ -786,69 +1791,333 @@ int Map::findLeafId(const Vector3f &pos) const
     }
   }
   
-  // This wierd return is here because leafs are stored with their
-  // negative indices + 1
-  return -1 - nextNode;
+  // This wierd return is here because leafs are stored with their
+  // negative indices + 1
+  return -1 - nextNode;
+}
+    
+void Map::buildFacePolygons()
+{
+  d->leafPolygons.resize(d->leafs.size() + 1);
+  d->polygons.clear();
+  d->polygonVertices.clear();
+  
+  for (int leaf = 0; leaf < d->leafs.size(); leaf++) {
+    int firstFace = d->leafs[leaf].firstleafface;
+    int lastFace = d->leafs[leaf].numleaffaces + firstFace;
+    d->leafPolygons[leaf] = d->polygons.size();
+    
+    for (int i = firstFace; i < lastFace; i++) {
+      int face = d->leaffaces[i];
+      if (!(d->xfaces[face]->getType() & 0x00000001))
+        continue;
+      
+      face_polygon_t polygon;
+      polygon.face = face;
+      polygon.firstVertex = d->polygonVertices.size();
+      polygon.numVertices = d->faces[face].numedges;
+      polygon.mins[0] = polygon.mins[1] = std::numeric_limits<float>::max();
+      polygon.maxs[0] = polygon.maxs[1] = -std::numeric_limits<float>::max();
+      
+      for (int j = 0; j < d->faces[face].numedges; j++) {
+        int edge = d->surfedges[j + d->faces[face].firstedge];
+        const vertex_t &v = d->vertices[edge > 0 ? d->edges[edge].v[0] : d->edges[-edge].v[1]];
+        face_vertex_t fv = { v.origin[0], v.origin[1] };
+        d->polygonVertices.push_back(fv);
+        
+        polygon.mins[0] = std::min(polygon.mins[0], fv.x);
+        polygon.mins[1] = std::min(polygon.mins[1], fv.y);
+        polygon.maxs[0] = std::max(polygon.maxs[0], fv.x);
+        polygon.maxs[1] = std::max(polygon.maxs[1], fv.y);
+      }
+      
+      d->polygons.push_back(polygon);
+    }
+  }
+  
+  d->leafPolygons[d->leafs.size()] = d->polygons.size();
+}
+
+void Map::buildAreaGraph()
+{
+  d->faceAreas.assign(d->xfaces.size(), -1);
+  d->areaOrigins.assign(d->areas.size(), Vector3f(0, 0, 0));
+  d->areaNeighbours.assign(d->areas.size(), std::vector<int>());
+  
+  // Faces belong to the area of the first non-solid leaf that references
+  // them; area zero is reserved for the outside of the map
+  for (int leaf = 0; leaf < d->leafs.size(); leaf++) {
+    int area = d->leafs[leaf].area;
+    if (area <= 0 || area >= d->areas.size())
+      continue;
+    
+    int firstFace = d->leafs[leaf].firstleafface;
+    int lastFace = d->leafs[leaf].numleaffaces + firstFace;
+    for (int i = firstFace; i < lastFace; i++) {
+      if (d->faceAreas[d->leaffaces[i]] == -1)
+        d->faceAreas[d->leaffaces[i]] = area;
+    }
+  }
+  
+  // Area origins are averages of their walkable face origins
+  std::vector<int> faceCounts(d->areas.size(), 0);
+  for (size_t i = 0; i < d->xfaces.size(); i++) {
+    int area = d->faceAreas[i];
+    if (area == -1 || !(d->xfaces[i]->getType() & 0x00000001))
+      continue;
+    
+    d->areaOrigins[area] += d->xfaces[i]->getOrigin();
+    faceCounts[area]++;
+  }
+  
+  for (int area = 0; area < d->areas.size(); area++) {
+    if (faceCounts[area])
+      d->areaOrigins[area] /= faceCounts[area];
+  }
+  
+  // Areas are connected by area portals and by any face links that cross
+  // area boundaries
+  std::set<std::pair<int, int> > connections;
+  for (int area = 1; area < d->areas.size(); area++) {
+    for (int i = 0; i < d->areas[area].numareaportals; i++) {
+      int portal = d->areas[area].firstareaportal + i;
+      if (portal < 0 || portal >= d->areaportals.size())
+        continue;
+      
+      int other = d->areaportals[portal].otherarea;
+      if (other > 0 && other < d->areas.size() && other != area)
+        connections.insert(std::make_pair(area, other));
+    }
+  }
+  
+  for (size_t i = 0; i < d->xfaces.size(); i++) {
+    int area = d->faceAreas[i];
+    BOOST_FOREACH(MapLink *link, d->xfaces[i]->links()) {
+      int other = d->faceAreas[link->getFace()->getIndex()];
+      if (area != -1 && other != -1 && area != other)
+        connections.insert(std::make_pair(area, other));
+    }
+  }
+  
+  typedef std::pair<int, int> AreaPair;
+  BOOST_FOREACH(const AreaPair &c, connections) {
+    d->areaNeighbours[c.first].push_back(c.second);
+  }
+  
+  getLogger()->info(format("Built area graph with %d areas and %d connections.") % d->areas.size() % connections.size());
+}
+
+bool Map::loadVisibility()
+{
+  d->clusterCount = 0;
+  d->clusterRowSize = 0;
+  d->pvs.clear();
+  
+  // Maps without visibility information see everything
+  const unsigned char *vis = d->vislist.data();
+  int visSize = d->vislist.size();
+  if (visSize < (int) sizeof(int32_t))
+    return true;
+  
+  // The lump starts with the number of clusters followed by PVS and PHS
+  // offsets of each cluster
+  int32_t clusters;
+  memcpy(&clusters, vis, sizeof(int32_t));
+  if (clusters <= 0 || clusters > (visSize - (int) sizeof(int32_t)) / (2 * (int) sizeof(int32_t)))
+    return false;
+  
+  int rowSize = (clusters + 7) / 8;
+  std::vector<unsigned char> pvs(clusters * rowSize, 0);
+  for (int cluster = 0; cluster < clusters; cluster++) {
+    int32_t offset;
+    memcpy(&offset, vis + sizeof(int32_t) * (1 + 2*cluster), sizeof(int32_t));
+    if (offset < 0 || offset >= visSize)
+      return false;
+    
+    // Decompress the run-length encoded row; zero bytes are followed by
+    // the number of zero bytes in the run
+    unsigned char *row = &pvs[cluster * rowSize];
+    for (int i = 0; i < rowSize;) {
+      if (offset >= visSize)
+        return false;
+      
+      if (vis[offset]) {
+        row[i++] = vis[offset++];
+      } else {
+        if (offset + 1 >= visSize)
+          return false;
+        
+        i += vis[offset + 1];
+        offset += 2;
+      }
+    }
+  }
+  
+  d->clusterCount = clusters;
+  d->clusterRowSize = rowSize;
+  d->pvs.swap(pvs);
+  getLogger()->info(format("Loaded visibility data for %d clusters.") % clusters);
+  return true;
+}
+
+/**
+ * Reads the next token from the entities lump. Tokens are braces or
+ * (possibly quoted) strings separated by whitespace; comments are
+ * skipped.
+ *
+ * @param p Current position, advanced past the token
+ * @param end End of the entities lump
+ * @param token Where to save the token
+ * @return True when a token was read, false at the end of the lump
+ */
+static bool parseEntityToken(const char *&p, const char *end, std::string *token)
+{
+  token->clear();
+  
+  // Skip whitespace and comments
+  for (;;) {
+    while (p < end && *p != 0 && (unsigned char) *p <= ' ')
+      p++;
+    
+    if (p + 1 < end && p[0] == '/' && p[1] == '/') {
+      while (p < end && *p != 0 && *p != '\n')
+        p++;
+    } else {
+      break;
+    }
+  }
+  
+  if (p >= end || *p == 0)
+    return false;
+  
+  if (*p == '"') {
+    // Quoted string, may contain whitespace
+    const char *start = ++p;
+    while (p < end && *p != 0 && *p != '"')
+      p++;
+    
+    token->assign(start, p);
+    if (p < end && *p == '"')
+      p++;
+  } else if (*p == '{' || *p == '}') {
+    token->assign(p, p + 1);
+    p++;
+  } else {
+    const char *start = p;
+    while (p < end && *p != 0 && (unsigned char) *p > ' ')
+      p++;
+    
+    token->assign(start, p);
+  }
+  
+  return true;
+}
+
+bool Map::loadEntities()
+{
+  d->entities.clear();
+  
+  const char *p = d->entityText.data();
+  const char *end = p + d->entityText.size();
+  std::string token;
+  
+  while (parseEntityToken(p, end, &token)) {
+    if (token != "{")
+      return false;
+    
+    // Collect the key/value pairs we are interested in
+    MapEntity entity;
+    bool hasOrigin = false;
+    for (;;) {
+      std::string key, value;
+      if (!parseEntityToken(p, end, &key))
+        return false;
+      
+      if (key == "}")
+        break;
+      
+      if (!parseEntityToken(p, end, &value) || value == "}")
+        return false;
+      
+      if (key == "classname") {
+        entity.classname = value;
+      } else if (key == "origin") {
+        float x, y, z;
+        if (sscanf(value.c_str(), "%f %f %f", &x, &y, &z) == 3) {
+          entity.origin = Vector3f(x, y, z);
+          hasOrigin = true;
+        }
+      }
+    }
+    
+    if (hasOrigin && !entity.classname.empty())
+      d->entities.push_back(entity);
+  }
+  
+  getLogger()->info(format("Loaded %d placed entities.") % d->entities.size());
+  return true;
+}
+
+const std::vector<MapEntity> &Map::getEntities() const
+{
+  return d->entities;
+}
+
+bool Map::isPotentiallyVisible(const Vector3f &from, const Vector3f &to) const
+{
+  if (!d->clusterCount)
+    return true;
+  
+  int fromCluster = d->leafs[findLeafId(from)].cluster;
+  int toCluster = d->leafs[findLeafId(to)].cluster;
+  
+  // Points in leafs without a cluster are not covered by visibility data
+  if (fromCluster < 0 || toCluster < 0 || fromCluster >= d->clusterCount || toCluster >= d->clusterCount)
+    return true;
+  
+  return d->pvs[fromCluster * d->clusterRowSize + (toCluster >> 3)] & (1 << (toCluster & 7));
 }
-    
+
 int Map::findFaceId(const Vector3f &pos) const
 {
   int leaf = findLeafId(pos);
-  int firstFace = d->leafs[leaf].firstleafface;
-  int lastFace = d->leafs[leaf].numleaffaces + firstFace;
-  int possible = 0;
-  int hits;
-  int v0, v1;
-  float dx, dy, t;
-  
-  for (int i = firstFace; i < lastFace; i++) {
-    int face = d->leaffaces[i];
-    
-    if (d->xfaces[face]->getType() & 0x00000001) {
-      int firstEdge = d->faces[face].firstedge;
-      int lastEdge = d->faces[face].numedges + firstEdge;
-      hits = 0;
+  const float x = pos[0];
+  const float y = pos[1];
+  
+  for (int i = d->leafPolygons[leaf]; i < d->leafPolygons[leaf + 1]; i++) {
+    const face_polygon_t &polygon = d->polygons[i];
+    
+    // Reject faces whose bounding box does not contain the point
+    if (x < polygon.mins[0] || x > polygon.maxs[0] || y < polygon.mins[1] || y > polygon.maxs[1])
+      continue;
+    
+    // Count crossings of a ray cast from the point towards +X
+    const face_vertex_t *vertices = &d->polygonVertices[polygon.firstVertex];
+    int hits = 0;
+    for (int j = 0; j < polygon.numVertices; j++) {
+      const face_vertex_t &v0 = vertices[j];
+      const face_vertex_t &v1 = vertices[j + 1 < polygon.numVertices ? j + 1 : 0];
+      float dx = v1.x - v0.x;
+      float dy = v1.y - v0.y;
       
-      for (int j = firstEdge; j < lastEdge; j++) {
-        int edge = d->surfedges[j];
-        
-        if (edge > 0) {
-          v0 = d->edges[edge].v[0];
-          v1 = d->edges[edge].v[1];
-        } else {
-          edge = -edge;
-          v0 = d->edges[edge].v[1];
-          v1 = d->edges[edge].v[0];
-        }
-        
-        dx = d->vertices[v1].origin[0] - d->vertices[v0].origin[0];
-        dy = d->vertices[v1].origin[1] - d->vertices[v0].origin[1];
-        if (dy == 0) {
-          if (pos[1] == d->vertices[v0].origin[1]) {
-            if (pos[0] >= d->vertices[v0].origin[0] && pos[0] <= d->vertices[v1].origin[0]) {
-              return face;
-            }
-            
-            if (pos[0] >= d->vertices[v1].origin[0] && pos[0] <= d->vertices[v0].origin[0]) {
-              return face;
-            }
-          }
-        } else {
-          t = (pos[1] - d->vertices[v0].origin[1]) / dy;
-          if (t < 1 && t >= 0) {
-            if ((t*dx + d->vertices[v0].origin[0]) == pos[0]) {
-              return face;
-            } else if ((t*dx + d->vertices[v0].origin[0]) >= pos[0]) {
-              hits++;
-            }
-          }
+      if (dy == 0) {
+        // Point lies on a horizontal edge
+        if (y == v0.y && x >= std::min(v0.x, v1.x) && x <= std::max(v0.x, v1.x))
+          return polygon.face;
+      } else {
+        float t = (y - v0.y) / dy;
+        if (t < 1 && t >= 0) {
+          float cx = t*dx + v0.x;
+          if (cx == x)
+            return polygon.face;
+          else if (cx >= x)
+            hits++;
         }
       }
-      
-      if (hits == 1) {
-        return face;
-      }
     }
+    
+    if (hits == 1)
+      return polygon.face;
   }
   
   return -1;
@@ -878,62 +2147,115 @@ bool Map::findPath(const Vector3f &start, const Vector3f &end, MapPath *path, bo
     return false;
   }
   
-  MapFace *startFace = d->xfaces[startFaceId];
-  MapFace *endFace = d->xfaces[endFaceId];
+  // Plan across areas first and then only search faces in the areas that
+  // are on the route; when the area route is too coarse for the faces to
+  // be connected, fall back to searching the whole map
+  std::vector<bool> corridor;
+  if (findAreaRoute(startFaceId, endFaceId, &corridor)) {
+    if (searchPath(end, startFaceId, endFaceId, &corridor, path, full))
+      return true;
+  }
+  
+  return searchPath(end, startFaceId, endFaceId, NULL, path, full);
+}
+
+bool Map::findAreaRoute(int startFaceId, int endFaceId, std::vector<bool> *corridor) const
+{
+  int startArea = d->faceAreas[startFaceId];
+  int endArea = d->faceAreas[endFaceId];
+  if (startArea == -1 || endArea == -1 || startArea == endArea)
+    return false;
+  
+  // A* over the area graph; the area graph is small, so plain containers
+  // are good enough here
+  typedef std::pair<float, int> CostArea;
+  int areaCount = d->areas.size();
+  std::vector<float> costG(areaCount, std::numeric_limits<float>::max());
+  std::vector<int> parent(areaCount, -1);
+  std::vector<bool> closed(areaCount, false);
+  std::priority_queue<CostArea, std::vector<CostArea>, std::greater<CostArea> > open;
+  const Vector3f &goal = d->areaOrigins[endArea];
+  
+  costG[startArea] = 0;
+  open.push(CostArea((d->areaOrigins[startArea] - goal).norm(), startArea));
+  while (!open.empty()) {
+    int area = open.top().second;
+    open.pop();
+    if (closed[area])
+      continue;
+    
+    closed[area] = true;
+    if (area == endArea)
+      break;
+    
+    BOOST_FOREACH(int neigh, d->areaNeighbours[area]) {
+      float score = costG[area] + (d->areaOrigins[area] - d->areaOrigins[neigh]).norm();
+      if (!closed[neigh] && score < costG[neigh]) {
+        costG[neigh] = score;
+        parent[neigh] = area;
+        open.push(CostArea(score + (d->areaOrigins[neigh] - goal).norm(), neigh));
+      }
+    }
+  }
+  
+  if (!closed[endArea])
+    return false;
+  
+  corridor->assign(areaCount, false);
+  for (int area = endArea; area != -1; area = parent[area]) {
+    (*corridor)[area] = true;
+  }
   
-  // Convenience data type for comparisons
-  typedef std::pair<float, MapFace*> CostMapFace;
-  typedef std::pair<MapFace*, MapLink*> FaceLink;
+  return true;
+}
+
+bool Map::searchPath(const Vector3f &end, int startFaceId, int endFaceId, const std::vector<bool> *corridor,
+                     MapPath *path, bool full) const
+{
+  MapFace *endFace = d->xfaces[endFaceId];
   
-  boost::unordered_map<MapFace*, float> costF, costG;
-  std::priority_queue<CostMapFace, std::vector<CostMapFace>, std::greater<CostMapFace> > open;
-  boost::unordered_map<MapFace*, bool> openMap;
-  boost::unordered_map<MapFace*, bool> closed;
-  boost::unordered_map<MapFace*, FaceLink> reversePath;
+  // Search state is reused between searches made through this instance
+  ScratchLease<MapSearch> search(m_scratch->searches);
   bool found = false;
+  search->begin(d->xfaces.size());
   
   // Initialize A* search
-  costG[startFace] = 0;
-  costF[startFace] = startFace->heuristic(endFace);
-  open.push(CostMapFace(costF[startFace], startFace));
-  openMap[startFace] = true;
+  search->costG[startFaceId] = 0;
+  search->costF[startFaceId] = d->xfaces[startFaceId]->heuristic(endFace);
+  search->push(startFaceId);
   
-  while (!open.empty()) {
-    CostMapFace cmf = open.top();
-    MapFace *face = cmf.second;
-    open.pop();
-    openMap.erase(face);
+  while (!search->empty()) {
+    int faceId = search->pop();
+    MapFace *face = d->xfaces[faceId];
     
     // Check goal condition
-    if (face == endFace) {
+    if (faceId == endFaceId) {
       found = true;
       if (!full)
         return true;
       break;
     }
     
-    closed[face] = true;
-    
     // Check all links
     BOOST_FOREACH(MapLink *link, face->links()) {
       MapFace *neigh = link->getFace();
-      if (closed.find(neigh) != closed.end() || !link->isValid())
+      int neighId = neigh->getIndex();
+      int state = search->getState(neighId);
+      const MapLinkState &linkState = m_linkStates[link->getIndex()];
+      if (state == MapSearch::Closed || !linkState.isValid())
         continue;
       
-      bool better = false;
-      float score = costG[face] + link->getCost() * (face->getOrigin() - neigh->getOrigin()).norm();
-      if (openMap.find(neigh) == openMap.end()) {
-        better = true;
-      } else if (score < costG[neigh]) {
-        better = true;
-      }
+      // Only consider faces inside the area corridor
+      if (corridor && d->faceAreas[neighId] != -1 && !(*corridor)[d->faceAreas[neighId]])
+        continue;
       
-      if (better) {
-        reversePath[neigh] = FaceLink(face, link);
-        costG[neigh] = score;
-        costF[neigh] = score + neigh->heuristic(endFace);
-        open.push(CostMapFace(costF[neigh], neigh));
-        openMap[neigh] = true;
+      float score = search->costG[faceId] + linkState.getCost() * (face->getOrigin() - neigh->getOrigin()).norm();
+      if (state == MapSearch::Unvisited || score < search->costG[neighId]) {
+        search->parentFace[neighId] = faceId;
+        search->parentLink[neighId] = link;
+        search->costG[neighId] = score;
+        search->costF[neighId] = score + neigh->heuristic(endFace);
+        search->push(neighId);
       }
     }
   }
@@ -941,24 +2263,19 @@ bool Map::findPath(const Vector3f &start, const Vector3f &end, MapPath *path, bo
   // When a path has been found, reconstruct it
   if (found) {
     Vector3f playerHeight(0, 0, 24.);
-    MapFace *face = endFace;
+    int faceId = endFaceId;
     path->points.push_back(end + playerHeight);
     
-    while (face != startFace) {
-      path->points.push_back(face->getOrigin() + playerHeight);
-      
-      if (reversePath.find(face) != reversePath.end()) {
-        FaceLink fl = reversePath[face];
-        path->points.push_back(fl.second->getOrigin() + playerHeight);
-        path->links.push_back(fl.second);
-        face = fl.first;
-      } else {
-        return false;
-      }
+    while (faceId != startFaceId) {
+      MapLink *link = search->parentLink[faceId];
+      path->points.push_back(d->xfaces[faceId]->getOrigin() + playerHeight);
+      path->points.push_back(link->getOrigin() + playerHeight);
+      path->links.push_back(link);
+      faceId = search->parentFace[faceId];
     }
     
     // Insert origin face
-    path->points.push_back(startFace->getOrigin() + playerHeight);
+    path->points.push_back(d->xfaces[startFaceId]->getOrigin() + playerHeight);
     
     // Reverse everything
     std::reverse(path->points.begin(), path->points.end());
@@ -1091,6 +2408,376 @@ float Map::intersectTree(const Vector3f &start, const Vector3f &end, int node, f
   }
 }
 
+#ifdef __SSE2__
+// Packet traversal stack size (BSP trees of real maps are far shallower)
+enum { packet_stack_size = 256 };
+
+/**
+ * Selects elements from a where mask is set and from b elsewhere.
+ */
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/**
+ * Returns a lane mask for the given four bit active mask.
+ */
+static inline __m128 lane_mask_ps(int active)
+{
+  static const int masks[16][4] __attribute__((aligned(16))) = {
+    { 0,  0,  0,  0}, {-1,  0,  0,  0}, { 0, -1,  0,  0}, {-1, -1,  0,  0},
+    { 0,  0, -1,  0}, {-1,  0, -1,  0}, { 0, -1, -1,  0}, {-1, -1, -1,  0},
+    { 0,  0,  0, -1}, {-1,  0,  0, -1}, { 0, -1,  0, -1}, {-1, -1,  0, -1},
+    { 0,  0, -1, -1}, {-1,  0, -1, -1}, { 0, -1, -1, -1}, {-1, -1, -1, -1}
+  };
+  
+  return _mm_load_ps(reinterpret_cast<const float*>(masks[active]));
+}
+
+/**
+ * An entry on the packet traversal stack.
+ */
+struct packet_entry_t {
+  __m128 min;
+  __m128 max;
+  int node;
+  int active;
+};
+#endif
+
+void Map::intersectTreePacket(const Vector3f *start, const Vector3f *end, int count, int mask, float *fractions) const
+{
+#ifdef __SSE2__
+  // Transpose rays into SSE registers; unused lanes replicate the first
+  // ray and are never activated
+  float s[3][4], t[3][4];
+  for (int i = 0; i < 4; i++) {
+    int r = i < count ? i : 0;
+    for (int j = 0; j < 3; j++) {
+      s[j][i] = start[r][j];
+      t[j][i] = end[r][j] - start[r][j];
+    }
+  }
+  
+  const __m128 S[3] = { _mm_loadu_ps(s[0]), _mm_loadu_ps(s[1]), _mm_loadu_ps(s[2]) };
+  const __m128 T[3] = { _mm_loadu_ps(t[0]), _mm_loadu_ps(t[1]), _mm_loadu_ps(t[2]) };
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 parallel = _mm_set1_ps(999999);
+  __m128 hit = _mm_set1_ps(1.0);
+  
+  // Hits are recorded as the minimum entry fraction of all solid leaves a
+  // ray passes through, which is the same as the first hit of a front to
+  // back traversal, so rays in a packet may visit children in any order
+  packet_entry_t stack[packet_stack_size];
+  int top = 0;
+  packet_entry_t e;
+  e.node = d->models[0].rootnode;
+  e.min = zero;
+  e.max = _mm_set1_ps(1.0);
+  e.active = (1 << count) - 1;
+  
+  for (;;) {
+    // Drop rays that already hit something before this subtree
+    e.active &= ~_mm_movemask_ps(_mm_cmple_ps(hit, e.min));
+    
+    if (e.active && e.node < 0) {
+      // Leaf
+      if (intersectLeaf(-1 - e.node, mask))
+        hit = select_ps(lane_mask_ps(e.active), _mm_min_ps(hit, e.min), hit);
+      e.active = 0;
+    }
+    
+    if (!e.active) {
+      if (top == 0)
+        break;
+      
+      e = stack[--top];
+      continue;
+    }
+    
+    const node_t &node = d->nodes[e.node];
+    const plane_t &plane = d->planes[node.planenum];
+    const __m128 pdist = _mm_set1_ps(plane.dist);
+    __m128 tmp, back;
+    
+    if (plane.type < 3) {
+      // X, Y or Z planes
+      const __m128 n = _mm_set1_ps(plane.normal[plane.type]);
+      const __m128 st = S[plane.type];
+      const __m128 tt = T[plane.type];
+      tmp = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(n, pdist), st), tt);
+      tmp = select_ps(_mm_cmpeq_ps(tt, zero), parallel, tmp);
+      back = _mm_cmplt_ps(_mm_mul_ps(st, n), pdist);
+    } else {
+      // ? plane
+      const __m128 nx = _mm_set1_ps(plane.normal[0]);
+      const __m128 ny = _mm_set1_ps(plane.normal[1]);
+      const __m128 nz = _mm_set1_ps(plane.normal[2]);
+      __m128 l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(T[0], nx), _mm_mul_ps(T[1], ny)), _mm_mul_ps(T[2], nz));
+      __m128 sn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(S[0], nx), _mm_mul_ps(S[1], ny)), _mm_mul_ps(S[2], nz));
+      tmp = _mm_div_ps(_mm_sub_ps(pdist, sn), l);
+      tmp = select_ps(_mm_cmpeq_ps(l, zero), parallel, tmp);
+      back = _mm_cmplt_ps(sn, pdist);
+    }
+    
+    // Classify each ray against the splitting plane
+    __m128 nearOnly = _mm_or_ps(_mm_cmpge_ps(tmp, e.max), _mm_cmple_ps(tmp, zero));
+    __m128 farOnly = _mm_andnot_ps(nearOnly, _mm_cmple_ps(tmp, e.min));
+    __m128 split = _mm_andnot_ps(_mm_or_ps(nearOnly, farOnly), _mm_cmpeq_ps(zero, zero));
+    int nearMask = e.active & ~_mm_movemask_ps(farOnly);
+    int farMask = e.active & ~_mm_movemask_ps(nearOnly);
+    int backSide = _mm_movemask_ps(back);
+    __m128 nearMax = select_ps(split, tmp, e.max);
+    __m128 farMin = select_ps(split, tmp, e.min);
+    
+    packet_entry_t front, rear;
+    front.node = node.front;
+    front.active = (nearMask & ~backSide) | (farMask & backSide);
+    front.min = select_ps(back, farMin, e.min);
+    front.max = select_ps(back, e.max, nearMax);
+    rear.node = node.back;
+    rear.active = (nearMask & backSide) | (farMask & ~backSide);
+    rear.min = select_ps(back, e.min, farMin);
+    rear.max = select_ps(back, nearMax, e.max);
+    
+    // Continue on the side where most of the rays start, so more rays
+    // can be culled early, and defer the other side
+    bool backFirst = __builtin_popcount(e.active & backSide) > __builtin_popcount(e.active & ~backSide);
+    packet_entry_t &later = backFirst ? front : rear;
+    e = backFirst ? rear : front;
+    
+    if (!later.active) {
+      continue;
+    } else if (later.node < 0) {
+      // Leaves can be checked right away instead of being deferred
+      if (intersectLeaf(-1 - later.node, mask))
+        hit = select_ps(lane_mask_ps(later.active), _mm_min_ps(hit, later.min), hit);
+    } else if (top < packet_stack_size) {
+      stack[top++] = later;
+    } else {
+      // Stack overflow, trace the deferred rays one by one
+      float mins[4], maxs[4], hits[4];
+      _mm_storeu_ps(mins, later.min);
+      _mm_storeu_ps(maxs, later.max);
+      _mm_storeu_ps(hits, hit);
+      for (int i = 0; i < count; i++) {
+        if (later.active & (1 << i))
+          hits[i] = std::min(hits[i], intersectTree(start[i], end[i], later.node, mins[i], maxs[i], mask));
+      }
+      hit = _mm_loadu_ps(hits);
+    }
+  }
+  
+  float hits[4];
+  _mm_storeu_ps(hits, hit);
+  for (int i = 0; i < count; i++) {
+    fractions[i] = hits[i];
+  }
+#else
+  for (int i = 0; i < count; i++) {
+    fractions[i] = intersectTree(start[i], end[i], d->models[0].rootnode, 0.0, 1.0, mask);
+  }
+#endif
+}
+
+// Distance to keep from brush surfaces during box traces
+static const float dist_epsilon = 0.03125;
+
+/**
+ * State of a single box trace through the BSP tree.
+ */
+struct box_trace_t {
+  Vector3f start;
+  Vector3f end;
+  Vector3f mins;
+  Vector3f maxs;
+  Vector3f extents;
+  bool point;
+  int mask;
+  float fraction;
+  bool startSolid;
+  bool allSolid;
+  brush_checks_t *checks;
+};
+
+/**
+ * Clips the traced box against a single brush and updates the trace
+ * fraction when the box enters the brush earlier than before.
+ */
+static void clipBoxToBrush(const MapPrivate *d, box_trace_t *trace, const brush_t &brush)
+{
+  float enterFrac = -1.0;
+  float leaveFrac = 1.0;
+  bool getOut = false;
+  bool startOut = false;
+  
+  if (!brush.numsides)
+    return;
+  
+  for (int i = 0; i < brush.numsides; i++) {
+    const plane_t &plane = d->planes[d->brushsides[brush.firstside + i].planenum];
+    Vector3f normal(plane.normal[0], plane.normal[1], plane.normal[2]);
+    float dist = plane.dist;
+    
+    // Push the plane out by the box corner that is closest to it
+    if (!trace->point) {
+      Vector3f ofs;
+      for (int j = 0; j < 3; j++) {
+        ofs[j] = normal[j] < 0 ? trace->maxs[j] : trace->mins[j];
+      }
+      dist -= ofs.dot(normal);
+    }
+    
+    float d1 = trace->start.dot(normal) - dist;
+    float d2 = trace->end.dot(normal) - dist;
+    
+    if (d2 > 0)
+      getOut = true;
+    if (d1 > 0)
+      startOut = true;
+    
+    // Completely in front of this side, so the brush is never entered
+    if (d1 > 0 && d2 >= d1)
+      return;
+    
+    // Completely behind this side
+    if (d1 <= 0 && d2 <= 0)
+      continue;
+    
+    if (d1 > d2) {
+      // Entering the brush
+      float f = (d1 - dist_epsilon) / (d1 - d2);
+      if (f > enterFrac)
+        enterFrac = f;
+    } else {
+      // Leaving the brush
+      float f = (d1 + dist_epsilon) / (d1 - d2);
+      if (f < leaveFrac)
+        leaveFrac = f;
+    }
+  }
+  
+  if (!startOut) {
+    // The box starts inside this brush
+    trace->startSolid = true;
+    if (!getOut) {
+      trace->allSolid = true;
+      trace->fraction = 0.0;
+    }
+    return;
+  }
+  
+  if (enterFrac < leaveFrac && enterFrac > -1 && enterFrac < trace->fraction)
+    trace->fraction = std::max(enterFrac, 0.0f);
+}
+
+/**
+ * Clips the traced box against all brushes of a leaf.
+ */
+static void traceToLeaf(MapPrivate *d, box_trace_t *trace, int leafId)
+{
+  const leaf_t &leaf = d->leafs[leafId];
+  if (!(leaf.contents & trace->mask))
+    return;
+  
+  for (int i = 0; i < leaf.numleafbrushes; i++) {
+    int brushId = d->leafbrushes[leaf.firstleafbrush + i];
+    if (trace->checks->checks[brushId] == trace->checks->count)
+      continue;
+    
+    trace->checks->checks[brushId] = trace->checks->count;
+    
+    const brush_t &brush = d->brushes[brushId];
+    if (!(brush.contents & trace->mask))
+      continue;
+    
+    clipBoxToBrush(d, trace, brush);
+    if (trace->fraction == 0.0)
+      return;
+  }
+}
+
+/**
+ * Sweeps the traced box through the BSP tree, visiting all leafs that
+ * the box touches between fractions p1f and p2f.
+ */
+static void traceHull(MapPrivate *d, box_trace_t *trace, int node, float p1f, float p2f, const Vector3f &p1, const Vector3f &p2)
+{
+  // Already hit something nearer
+  if (trace->fraction <= p1f)
+    return;
+  
+  if (node < 0) {
+    // Leaf
+    traceToLeaf(d, trace, -1 - node);
+    return;
+  }
+  
+  const node_t &n = d->nodes[node];
+  const plane_t &plane = d->planes[n.planenum];
+  float t1, t2, offset;
+  
+  if (plane.type < 3) {
+    // X, Y or Z planes
+    t1 = p1[plane.type] - plane.dist;
+    t2 = p2[plane.type] - plane.dist;
+    offset = trace->extents[plane.type];
+  } else {
+    // ? plane
+    Vector3f normal(plane.normal[0], plane.normal[1], plane.normal[2]);
+    t1 = p1.dot(normal) - plane.dist;
+    t2 = p2.dot(normal) - plane.dist;
+    if (trace->point)
+      offset = 0;
+    else
+      offset = std::abs(trace->extents[0] * normal[0]) +
+               std::abs(trace->extents[1] * normal[1]) +
+               std::abs(trace->extents[2] * normal[2]);
+  }
+  
+  // See which sides we need to consider
+  if (t1 >= offset && t2 >= offset) {
+    traceHull(d, trace, n.front, p1f, p2f, p1, p2);
+    return;
+  } else if (t1 < -offset && t2 < -offset) {
+    traceHull(d, trace, n.back, p1f, p2f, p1, p2);
+    return;
+  }
+  
+  // Put the crosspoint dist_epsilon pixels on the near side
+  bool back;
+  float frac, frac2;
+  if (t1 < t2) {
+    float idist = 1.0 / (t1 - t2);
+    back = true;
+    frac2 = (t1 + offset + dist_epsilon) * idist;
+    frac = (t1 - offset + dist_epsilon) * idist;
+  } else if (t1 > t2) {
+    float idist = 1.0 / (t1 - t2);
+    back = false;
+    frac2 = (t1 - offset - dist_epsilon) * idist;
+    frac = (t1 + offset + dist_epsilon) * idist;
+  } else {
+    back = false;
+    frac = 1.0;
+    frac2 = 0.0;
+  }
+  
+  frac = std::min(std::max(frac, 0.0f), 1.0f);
+  frac2 = std::min(std::max(frac2, 0.0f), 1.0f);
+  
+  // Move up to the node on the near side and then from the node on the
+  // far side
+  float midf = p1f + (p2f - p1f) * frac;
+  Vector3f mid = p1 + (p2 - p1) * frac;
+  traceHull(d, trace, back ? n.back : n.front, p1f, midf, p1, mid);
+  
+  midf = p1f + (p2f - p1f) * frac2;
+  mid = p1 + (p2 - p1) * frac2;
+  traceHull(d, trace, back ? n.front : n.back, midf, p2f, mid, p2);
+}
+
 int Map::pointContents(const Vector3f &point)
 {
   int num = d->models[0].rootnode;
@@ -1107,7 +2794,7 @@ int Map::pointContents(const Vector3f &point)
     else
       distance = Vector3f(plane.normal).dot(point) - plane.dist;
     
-    if (d < 0)
+    if (distance < 0)
       num = node.back;
     else
       num = node.front;
@@ -1116,13 +2803,281 @@ int Map::pointContents(const Vector3f &point)
   return d->leafs[-1 - num].contents;
 }
 
-float Map::rayTest(const Vector3f &start, const Vector3f &end, int mask)
+void Map::buildContentsGrid()
+{
+  d->hasContentsGrid = false;
+  d->gridBrickTable.clear();
+  d->gridCells.clear();
+  
+  // Cover the world model with bricks of cells
+  const model_t &world = d->models[0];
+  int cells[3];
+  size_t cellCount = 1;
+  for (int i = 0; i < 3; i++) {
+    float extent = world.maxs[i] - world.mins[i];
+    int brickSize = contents_brick_size * contents_cell_size;
+    d->gridOrigin[i] = world.mins[i];
+    d->gridBricks[i] = std::max(1, (int) ceil(extent / brickSize));
+    cells[i] = d->gridBricks[i] * contents_brick_size;
+    cellCount *= cells[i];
+  }
+  
+  if (cellCount > contents_max_cells) {
+    getLogger()->info(format("Map is too big for a contents grid (%d cells), using the BSP tree instead.") % cellCount);
+    return;
+  }
+  
+  // Sample contents at cell corners and centers, so that thin brushes
+  // are less likely to fall between samples
+  std::vector<int> corners((cells[0] + 1) * (cells[1] + 1) * (cells[2] + 1));
+  for (int z = 0, i = 0; z <= cells[2]; z++) {
+    for (int y = 0; y <= cells[1]; y++) {
+      for (int x = 0; x <= cells[0]; x++, i++) {
+        corners[i] = pointContents(d->gridOrigin + Vector3f(x, y, z) * contents_cell_size);
+      }
+    }
+  }
+  
+  // Cells whose samples disagree are flagged as mixed, queries for them
+  // go to the BSP tree instead of using the combined contents
+  std::vector<uint16_t> dense(cellCount);
+  std::vector<bool> solid(cellCount);
+  Vector3f half(contents_cell_size / 2, contents_cell_size / 2, contents_cell_size / 2);
+  for (int z = 0, i = 0; z < cells[2]; z++) {
+    for (int y = 0; y < cells[1]; y++) {
+      for (int x = 0; x < cells[0]; x++, i++) {
+        int center = pointContents(d->gridOrigin + Vector3f(x, y, z) * contents_cell_size + half);
+        int any = center, all = center;
+        for (int c = 0; c < 8; c++) {
+          int cx = x + (c & 1), cy = y + ((c >> 1) & 1), cz = z + (c >> 2);
+          int contents = corners[(cz * (cells[1] + 1) + cy) * (cells[0] + 1) + cx];
+          any |= contents;
+          all &= contents;
+        }
+        
+        dense[i] = any & contents_mask;
+        if (any != all)
+          dense[i] |= contents_mixed;
+        solid[i] = all & Solid;
+      }
+    }
+  }
+  
+  // A point is at most 48 units above the bottom of the third cell below
+  // it, so a fully solid cell there means ground within 50 units. When
+  // solid is only sampled somewhere further down, a ray has to decide.
+  size_t layer = cells[0] * cells[1];
+  for (size_t i = 0; i < cellCount; i++) {
+    int z = i / layer;
+    for (int k = 0; k <= contents_ground_search_cells && k <= z; k++) {
+      size_t below = i - k * layer;
+      if (k <= contents_ground_cells && solid[below]) {
+        dense[i] |= contents_ground;
+        break;
+      }
+      
+      if (dense[below] & Solid)
+        dense[i] |= contents_ground_maybe;
+    }
+  }
+  
+  // Pack cells into bricks, storing uniform bricks in the table only
+  uint16_t brick[contents_brick_cells];
+  d->gridBrickTable.resize(d->gridBricks[0] * d->gridBricks[1] * d->gridBricks[2]);
+  for (int bz = 0, b = 0; bz < d->gridBricks[2]; bz++) {
+    for (int by = 0; by < d->gridBricks[1]; by++) {
+      for (int bx = 0; bx < d->gridBricks[0]; bx++, b++) {
+        bool uniform = true;
+        for (int z = 0, i = 0; z < contents_brick_size; z++) {
+          for (int y = 0; y < contents_brick_size; y++) {
+            for (int x = 0; x < contents_brick_size; x++, i++) {
+              int cx = bx * contents_brick_size + x;
+              int cy = by * contents_brick_size + y;
+              int cz = bz * contents_brick_size + z;
+              brick[i] = dense[(cz * cells[1] + cy) * cells[0] + cx];
+              uniform = uniform && brick[i] == brick[0];
+            }
+          }
+        }
+        
+        if (uniform) {
+          d->gridBrickTable[b] = contents_uniform | brick[0];
+        } else {
+          d->gridBrickTable[b] = d->gridCells.size() / contents_brick_cells;
+          d->gridCells.insert(d->gridCells.end(), brick, brick + contents_brick_cells);
+        }
+      }
+    }
+  }
+  
+  d->hasContentsGrid = true;
+  getLogger()->info(format("Built contents grid with %d cells in %d bytes.") % cellCount %
+    (d->gridBrickTable.size() * sizeof(uint32_t) + d->gridCells.size() * sizeof(uint16_t)));
+}
+
+int Map::cellContents(const Vector3f &point)
+{
+  int cell = d->gridCell(point);
+  if (cell == -1 || (cell & contents_mixed))
+    return pointContents(point);
+  
+  return cell & contents_mask;
+}
+
+bool Map::isGroundBelow(const Vector3f &point)
+{
+  int cell = d->gridCell(point);
+  if (cell == -1 || (!(cell & contents_ground) && (cell & contents_ground_maybe)))
+    return rayTest(point, point - Vector3f(0, 0, 50.0), Solid) < 1.0;
+  
+  return cell & contents_ground;
+}
+
+float Map::rayTest(const Vector3f &start, const Vector3f &end, int mask, bool cached)
 {
   if (!mask)
     return 1.0;
   
-  return intersectTree(start, end, d->models[0].rootnode, 0.0, 1.0, mask);
+  if (!cached || !d->rayCacheCapacity.load(boost::memory_order_relaxed))
+    return intersectTree(start, end, d->models[0].rootnode, 0.0, 1.0, mask);
+  
+  float fraction;
+  Vector3f zero(0, 0, 0);
+  ray_cache_key_t key = d->rayCacheKey(start, end, zero, zero, mask, false);
+  if (d->rayCacheLookup(key, &fraction))
+    return fraction;
+  
+  fraction = intersectTree(start, end, d->models[0].rootnode, 0.0, 1.0, mask);
+  d->rayCacheInsert(key, fraction);
+  return fraction;
+}
+
+void Map::rayTestBatch(const Vector3f *start, const Vector3f *end, int count, int mask, float *fractions, bool cached)
+{
+  if (!mask) {
+    std::fill(fractions, fractions + count, 1.0f);
+    return;
+  }
+  
+  if (!cached || !d->rayCacheCapacity.load(boost::memory_order_relaxed)) {
+    for (int i = 0; i < count; i += 4) {
+      intersectTreePacket(start + i, end + i, std::min(4, count - i), mask, fractions + i);
+    }
+    return;
+  }
+  
+  // Only trace rays that are not in the cache, packing them together so
+  // they can still be traced in packets
+  Vector3f zero(0, 0, 0);
+  std::vector<ray_cache_key_t> keys;
+  std::vector<int> misses;
+  std::vector<Vector3f> missStart, missEnd;
+  for (int i = 0; i < count; i++) {
+    ray_cache_key_t key = d->rayCacheKey(start[i], end[i], zero, zero, mask, false);
+    if (d->rayCacheLookup(key, &fractions[i]))
+      continue;
+    
+    keys.push_back(key);
+    misses.push_back(i);
+    missStart.push_back(start[i]);
+    missEnd.push_back(end[i]);
+  }
+  
+  if (misses.empty())
+    return;
+  
+  std::vector<float> missFractions(misses.size());
+  for (size_t i = 0; i < misses.size(); i += 4) {
+    intersectTreePacket(&missStart[i], &missEnd[i], std::min(4, (int) (misses.size() - i)), mask, &missFractions[i]);
+  }
+  
+  for (size_t i = 0; i < misses.size(); i++) {
+    fractions[misses[i]] = missFractions[i];
+    d->rayCacheInsert(keys[i], missFractions[i]);
+  }
+}
+
+void Map::setRayCache(size_t capacity, float quantum)
+{
+  d->rayCacheCapacity.store(capacity, boost::memory_order_relaxed);
+  d->rayCacheQuantum.store(quantum, boost::memory_order_relaxed);
+  d->rayCacheGeneration.fetch_add(1, boost::memory_order_release);
+  
+  for (size_t i = 0; i < ray_cache_shards; i++) {
+    RayCacheShard &shard = d->rayCacheShards[i];
+    boost::lock_guard<boost::mutex> g(shard.mutex);
+    shard.entries.clear();
+    shard.index.clear();
+    shard.hits = 0;
+    shard.misses = 0;
+  }
+}
+
+Map::RayCacheStats Map::getRayCacheStats() const
+{
+  RayCacheStats stats;
+  stats.hits = 0;
+  stats.misses = 0;
+  stats.size = 0;
+  for (size_t i = 0; i < ray_cache_shards; i++) {
+    RayCacheShard &shard = d->rayCacheShards[i];
+    boost::lock_guard<boost::mutex> g(shard.mutex);
+    stats.hits += shard.hits;
+    stats.misses += shard.misses;
+    stats.size += shard.entries.size();
+  }
+  return stats;
 }
 
+float Map::traceBox(const Vector3f &start, const Vector3f &end, const Vector3f &mins, const Vector3f &maxs, int mask,
+                    bool cached)
+{
+  if (!mask || d->brushes.empty())
+    return 1.0;
+  
+  ray_cache_key_t key;
+  cached = cached && d->rayCacheCapacity.load(boost::memory_order_relaxed);
+  if (cached) {
+    float fraction;
+    key = d->rayCacheKey(start, end, mins, maxs, mask, true);
+    if (d->rayCacheLookup(key, &fraction))
+      return fraction;
+  }
+  
+  box_trace_t trace;
+  trace.start = start;
+  trace.end = end;
+  trace.mins = mins;
+  trace.maxs = maxs;
+  trace.mask = mask;
+  trace.fraction = 1.0;
+  trace.startSolid = false;
+  trace.allSolid = false;
+  trace.point = mins.isZero() && maxs.isZero();
+  for (int i = 0; i < 3; i++) {
+    trace.extents[i] = std::max(-mins[i], maxs[i]);
+  }
+  
+  // Start a new brush check round; counters are reset before they wrap
+  // around so no brush can be skipped because of a stale counter
+  ScratchLease<brush_checks_t> checks(m_scratch->brushChecks);
+  if (checks.isFresh()) {
+    checks->checks.assign(d->brushes.size(), 0);
+    checks->count = 0;
+  }
+  
+  if (checks->count == std::numeric_limits<int>::max()) {
+    std::fill(checks->checks.begin(), checks->checks.end(), 0);
+    checks->count = 0;
+  }
+  checks->count++;
+  trace.checks = checks.get();
+  
+  traceHull(d.get(), &trace, d->models[0].rootnode, 0.0, 1.0, start, end);
+  if (cached)
+    d->rayCacheInsert(key, trace.fraction);
+  
+  return trace.fraction;
 }
 
+}
@@ -12,10 +12,16 @@
 
 #include <Eigen/Geometry>
 
+#include <algorithm>
+
 using namespace Eigen;
 
 namespace HiveMind {
 
+// Player hull relative to player origin
+static const Vector3f hull_mins(-16, -16, -24);
+static const Vector3f hull_maxs(16, 16, 32);
+
 DistanceSensor::DistanceSensor()
   : m_context(NULL),
     m_map(NULL),
@@ -56,55 +62,42 @@ void DistanceSensor::update(const GameState &state, float yaw)
   p[2] = 0;
   p.normalize();
   
-  // Now simulate a walk so we handle stairs and detect gaps
+  // Now simulate a walk of the player hull so we handle stairs and detect
+  // gaps. The hull bottom is raised by the step height while moving
+  // forward, so stairs are climbed by the forward sweep itself, and the
+  // hull is then dropped to the ground to walk down stairs and find gaps.
+  // The hull can cross any gap narrower than itself, so it advances by
+  // its width on each step. The bot only moves a few units between
+  // frames, so trace results are taken from the map's ray cache.
+  Vector3f mins = hull_mins + Vector3f(0, 0, step_size);
+  Vector3f stepUp(0, 0, step_size);
+  Vector3f drop(0, 0, -5*step_size);
+  float maxDistance = m_senseDistance * step_size;
   float distance = 0.0;
-  Vector3f dest = origin;
-  p *= (float) step_size;
-  
-  // Step up the first stair
-  dest[2] += step_size;
-  float d = m_map->rayTest(origin, dest, Map::Solid);
-  origin += (dest - origin) * d;
-  dest = origin;
   
-  while (distance < m_senseDistance) {
-    dest = origin + p;
+  while (distance < maxDistance) {
+    float step = std::min((float) hull_step, maxDistance - distance);
+    Vector3f dest = origin + p * step;
     
     // Trace to nearest solid
     // TODO handle dynamic entities here (players)
-    d = m_map->rayTest(origin, dest, Map::Solid);
-    if (d < 1.0f) {
-      distance += d;
-      dest = origin + (dest - origin) * d;
-      break;
-    }
-    
+    float d = m_map->traceBox(origin, dest, mins, hull_maxs, Map::Solid, true);
     origin += (dest - origin) * d;
-    dest = origin;
+    if (d < 1.0f)
+      break;
     
     // Check for gaps or walk down stairs
-    dest[2] -= 4*step_size;
-    d = m_map->rayTest(origin, dest, Map::Solid);
-    if (d == 1.0f) {
-      dest = origin;
+    dest = origin + drop;
+    d = m_map->traceBox(origin, dest, mins, hull_maxs, Map::Solid, true);
+    if (d == 1.0f)
       break;
-    }
-    
-    origin += (dest - origin) * d;
-    dest = origin;
-    
-    // Automatically step up stairs
-    dest[2] += step_size;
-    d = m_map->rayTest(origin, dest, Map::Solid);
-    origin += (dest - origin) * d;
-    dest = origin;
     
-    // Increase distance
-    distance += 1;
+    origin += (dest - origin) * d + stepUp;
+    distance += step;
   }
   
   // Compute distance to obstacle
-  m_measure = (dest - state.player.origin).norm(); 
+  m_measure = (origin - state.player.origin).norm();
 }
 
 }
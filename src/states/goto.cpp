@@ -84,21 +84,13 @@ void GoToState::processPlanning()
         continue;
       }
 
-      // Find the nearest node that contains our item
-      GridNode *node = grid->getNearestItemNode(t.first, p);
-      if (node == NULL) {
+      // Only follow flow fields of items that are still around
+      if (!grid->getNearestItemNode(t.first, p)) {
         continue;
       }
 
-      // Find its exact location
-      Vector3f loc = Vector3f::Zero();
-      BOOST_FOREACH(Item item, node->items()) {
-        if (item.getType() == t.first) {
-          loc = item.getLocation();
-        }
-      }
-
-      if (grid->findPath(p, loc, &m_currentPath)) {
+      // Follow the flow field to the nearest node that contains our item
+      if (grid->findItemPath(t.first, p, &m_currentPath)) {
         getLogger()->info(format("Discovered a path of length %d to an item.") % m_currentPath.size());
         m_currItem = t.first;
         m_recompute = false;
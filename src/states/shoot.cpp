@@ -115,15 +115,32 @@ int ShootState::getClosestEnemy()
     if (dir->isFriend(i))
       continue;
     
-    // Check if the enemy is alive
+    // Check if the enemy is alive; ray test for different offsets at
+    // once as the rays share most of their path through the map and
+    // reuse results from previous frames when neither of us has moved
     Vector3f enemyPos = m_gameState->entities[i].origin;
+    Vector3f starts[4], ends[4];
+    float fractions[4];
     bool isAlive = false;
 
+    bool potentiallyVisible = false;
+
+    for (int j = 0; j <= 3; j++) {
+      starts[j] = origin;
+      ends[j] = enemyPos;
+      ends[j][2] += ENEMY_OFFSETS[j];
+      potentiallyVisible = potentiallyVisible || map->isPotentiallyVisible(origin, ends[j]);
+    }
+
+    // Skip rays altogether when the enemy is in a cluster we cannot see
+    if (!potentiallyVisible)
+      continue;
+
+    map->rayTestBatch(starts, ends, 4, Map::Solid, fractions, true);
     for (int j = 0; j <= 3; j++) {
-      // Ray test for different offsets
-      enemyPos[2] = m_gameState->entities[i].origin[2] + ENEMY_OFFSETS[j];
-      isAlive = (map->rayTest(origin, enemyPos, Map::Solid) >= 1.0);
-      if (isAlive) {
+      if (fractions[j] >= 1.0) {
+        enemyPos = ends[j];
+        isAlive = true;
         break;
       }
     }
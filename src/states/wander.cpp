@@ -75,6 +75,17 @@ void WanderState::recomputePath(bool randomize)
   m_randomize = randomize;
 }
 
+void WanderState::repairPath(bool blocked, bool randomize)
+{
+  Grid *grid = getContext()->getGrid();
+  if (grid->repairPath(m_gameState->player.origin, &m_currentPath, blocked)) {
+    m_speed = -1;
+    resetPointStatistics();
+  } else {
+    recomputePath(randomize);
+  }
+}
+
 void WanderState::processFrame()
 {
   Map *map = getContext()->getMap();
@@ -123,7 +134,7 @@ void WanderState::processFrame()
     if (m_speed < 10) {
       // Request to recompute the path
       //getLogger()->warning("We are stuck, but should be following a path!");
-      recomputePath();
+      repairPath(true);
     } else {
       // Check whether we will probably never reach our destination
       float distance = getDistanceToDestination();
@@ -155,10 +166,10 @@ void WanderState::processFrame()
           resetPointStatistics();
         } else if (diffZ > 24) {
           // Probably fell somewhere
-          //getLogger()->info("Probably fell somewhere. Recomputing a new path.");
-          recomputePath(true);
+          //getLogger()->info("Probably fell somewhere. Repairing the path.");
+          repairPath(false, true);
         } else {
-          recomputePath(true);
+          repairPath(true, true);
         }
 
         return;
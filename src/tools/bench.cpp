@@ -0,0 +1,434 @@
+/*
+ * This file is part of HiveMind distributed Quake 2 bot.
+ *
+ * Copyright (C) 2010 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2010 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ * Copyright (C) 2010 by Grega Kespret <grega.kespret@gmail.com>
+ */
+#include "context.h"
+#include "mapping/map.h"
+#include "mapping/grid.h"
+
+#include <ctime>
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+
+#include <boost/program_options.hpp>
+#include <boost/random.hpp>
+
+using namespace HiveMind;
+namespace po = boost::program_options;
+
+/**
+ * A grid exporter that only collects node locations, so benchmarks can
+ * use real player positions as query points.
+ */
+class LocationCollector : public GridExporter {
+public:
+    void open(size_t nodes) { locations.reserve(nodes); }
+    void exportWaypoint(GridNode *node, const GridWaypoint &wp) {}
+    void exportNode(GridNode *node) { locations.push_back(node->getLocation()); }
+    void startLinks() {}
+    void exportLink(GridNode *node, GridLink *link) {}
+    void close() {}
+
+    // Collected node locations
+    std::vector<Vector3f> locations;
+};
+
+/**
+ * Returns the current time in seconds with sub-millisecond precision.
+ */
+static double now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Compares scalar and batched ray casting on rays that resemble what the
+ * bot casts during a frame: sensor steps around a location and visibility
+ * rays towards other locations.
+ */
+static void benchRayTest(Map *map, const std::vector<Vector3f> &locations, int count, boost::mt19937 &gen)
+{
+  boost::uniform_int<> pick(0, locations.size() - 1);
+  boost::variate_generator<boost::mt19937&, boost::uniform_int<> > die(gen, pick);
+  std::vector<Vector3f> starts, ends;
+
+  while ((int) starts.size() < count) {
+    Vector3f origin = locations[die()];
+    Vector3f target = locations[die()];
+
+    // Sensor steps in four neighbouring directions
+    for (int i = 0; i < 4; i++) {
+      float angle = (10.0 * i / 180.0) * M_PI;
+      starts.push_back(origin);
+      ends.push_back(origin + Vector3f(18.0 * cos(angle), 18.0 * sin(angle), 0));
+    }
+
+    // Visibility rays with different vertical offsets
+    const float offsets[] = { 0.0, -16.0, 16.0, 32.0 };
+    for (int i = 0; i < 4; i++) {
+      starts.push_back(origin);
+      ends.push_back(target + Vector3f(0, 0, offsets[i]));
+    }
+  }
+
+  std::vector<float> scalar(starts.size()), batch(starts.size());
+  double t0 = now();
+  for (size_t i = 0; i < starts.size(); i++) {
+    scalar[i] = map->rayTest(starts[i], ends[i], Map::Solid);
+  }
+  double t1 = now();
+  map->rayTestBatch(&starts[0], &ends[0], starts.size(), Map::Solid, &batch[0]);
+  double t2 = now();
+
+  float maxDiff = 0.0;
+  for (size_t i = 0; i < starts.size(); i++) {
+    maxDiff = std::max(maxDiff, std::abs(scalar[i] - batch[i]));
+  }
+
+  std::cout << "rayTest:      " << starts.size() / (t1 - t0) << " rays/s" << std::endl;
+  std::cout << "rayTestBatch: " << starts.size() / (t2 - t1) << " rays/s" << std::endl;
+  std::cout << "Speedup: " << (t1 - t0) / (t2 - t1) << ", max difference: " << maxDiff << std::endl;
+}
+
+/**
+ * Measures ray cache efficiency for a given quantum by simulating bots
+ * that walk between grid locations a few units per frame and cast the
+ * same sensor rays each frame.
+ */
+static void benchRayCache(Map *map, const std::vector<Vector3f> &locations, int count, float quantum, boost::mt19937 &gen)
+{
+  boost::uniform_int<> pick(0, locations.size() - 1);
+  boost::variate_generator<boost::mt19937&, boost::uniform_int<> > die(gen, pick);
+  std::vector<Vector3f> starts, ends;
+
+  while ((int) starts.size() < count) {
+    Vector3f origin = locations[die()];
+    Vector3f target = locations[die()];
+    Vector3f direction = target - origin;
+    float length = direction.norm();
+    if (length < 1.0)
+      continue;
+
+    // Walk at the default bot speed of ~30 units per frame
+    direction /= length;
+    for (float walked = 0.0; walked < length && (int) starts.size() < count; walked += 30.0) {
+      Vector3f position = origin + direction * walked;
+      for (int i = -4; i <= 4; i++) {
+        float angle = (10.0 * i / 180.0) * M_PI;
+        starts.push_back(position);
+        ends.push_back(position + Vector3f(144.0 * cos(angle), 144.0 * sin(angle), 0));
+      }
+    }
+  }
+
+  map->setRayCache(4096, quantum);
+  double t0 = now();
+  for (size_t i = 0; i < starts.size(); i++) {
+    map->rayTest(starts[i], ends[i], Map::Solid);
+  }
+  double t1 = now();
+  for (size_t i = 0; i < starts.size(); i++) {
+    map->rayTest(starts[i], ends[i], Map::Solid, true);
+  }
+  double t2 = now();
+
+  Map::RayCacheStats stats = map->getRayCacheStats();
+  std::cout << "rayTest:          " << starts.size() / (t1 - t0) << " rays/s" << std::endl;
+  std::cout << "rayTest (cached): " << starts.size() / (t2 - t1) << " rays/s" << std::endl;
+  std::cout << "Quantum: " << quantum << ", hits: " << stats.hits << ", misses: " << stats.misses
+            << ", hit rate: " << (100.0 * stats.hits) / (stats.hits + stats.misses) << "%" << std::endl;
+}
+
+/**
+ * Measures path finding throughput between random pairs of walkable
+ * map faces.
+ */
+static void benchFindPath(Map *map, int count, boost::mt19937 &gen)
+{
+  std::vector<Vector3f> origins;
+  for (int i = 0; i < map->getFaceCount(); i++) {
+    MapFace *face = map->getFace(i);
+    if (face->getType() & 0x00000001)
+      origins.push_back(face->getOrigin() + Vector3f(0, 0, 1.0));
+  }
+
+  if (origins.empty()) {
+    std::cout << "ERROR: Map has no walkable faces!" << std::endl;
+    return;
+  }
+
+  boost::uniform_int<> pick(0, origins.size() - 1);
+  boost::variate_generator<boost::mt19937&, boost::uniform_int<> > die(gen, pick);
+  std::vector<std::pair<int, int> > pairs(count);
+  for (int i = 0; i < count; i++) {
+    pairs[i] = std::make_pair(die(), die());
+  }
+
+  MapPath path;
+  int found = 0;
+  size_t length = 0;
+  double t0 = now();
+  for (int i = 0; i < count; i++) {
+    if (map->findPath(origins[pairs[i].first], origins[pairs[i].second], &path)) {
+      found++;
+      length += path.links.size();
+    }
+  }
+  double t1 = now();
+
+  std::cout << "findPath: " << count / (t1 - t0) << " queries/s" << std::endl;
+  std::cout << "Found " << found << " of " << count << " paths, average length "
+            << (found ? (double) length / found : 0.0) << " links" << std::endl;
+}
+
+/**
+ * Replays path finding queries between random pairs of learned grid
+ * locations and reports query latency percentiles.
+ */
+static void benchGridPath(Grid *grid, const std::vector<Vector3f> &locations, int count, boost::mt19937 &gen)
+{
+  boost::uniform_int<> pick(0, locations.size() - 1);
+  boost::variate_generator<boost::mt19937&, boost::uniform_int<> > die(gen, pick);
+  std::vector<std::pair<int, int> > pairs(count);
+  for (int i = 0; i < count; i++) {
+    pairs[i] = std::make_pair(die(), die());
+  }
+
+  GridPath path;
+  std::vector<double> latencies(count);
+  int found = 0;
+  size_t length = 0;
+  double t0 = now();
+  for (int i = 0; i < count; i++) {
+    double start = now();
+    if (grid->findPath(locations[pairs[i].first], locations[pairs[i].second], &path)) {
+      found++;
+      length += path.size();
+    }
+    latencies[i] = now() - start;
+  }
+  double t1 = now();
+
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << "Grid::findPath: " << count / (t1 - t0) << " queries/s" << std::endl;
+  std::cout << "Latency p50: " << latencies[count / 2] * 1e6 << " us, p99: "
+            << latencies[(count * 99) / 100] * 1e6 << " us, max: " << latencies.back() * 1e6 << " us" << std::endl;
+  std::cout << "Found " << found << " of " << count << " paths, average length "
+            << (found ? (double) length / found : 0.0) << " nodes" << std::endl;
+}
+
+/**
+ * Measures nearest node lookup throughput for query points scattered
+ * around learned grid locations.
+ */
+static void benchNearestNode(Grid *grid, const std::vector<Vector3f> &locations, int count, boost::mt19937 &gen)
+{
+  boost::uniform_int<> pick(0, locations.size() - 1);
+  boost::variate_generator<boost::mt19937&, boost::uniform_int<> > die(gen, pick);
+  boost::uniform_real<float> horizontal(-20.0, 20.0), vertical(-10.0, 10.0);
+  boost::variate_generator<boost::mt19937&, boost::uniform_real<float> > jitterH(gen, horizontal), jitterV(gen, vertical);
+  std::vector<Vector3f> queries(count);
+  for (int i = 0; i < count; i++) {
+    queries[i] = locations[die()] + Vector3f(jitterH(), jitterH(), jitterV());
+  }
+
+  int found = 0, ground = 0;
+  double t0 = now();
+  for (int i = 0; i < count; i++) {
+    if (grid->getNearestNode(queries[i]))
+      found++;
+  }
+  double t1 = now();
+  for (int i = 0; i < count; i++) {
+    if (grid->getNodeByMedium(queries[i], GridNode::Ground))
+      ground++;
+  }
+  double t2 = now();
+
+  std::cout << "Grid::getNearestNode:  " << count / (t1 - t0) << " queries/s" << std::endl;
+  std::cout << "Grid::getNodeByMedium: " << count / (t2 - t1) << " queries/s" << std::endl;
+  std::cout << "Found " << found << " nearest and " << ground << " ground nodes of " << count << " queries" << std::endl;
+}
+
+/**
+ * Tree accessor for waypoint coordinates.
+ */
+static float waypoint_coordinate(GridWaypoint p, size_t n)
+{
+  return p[n];
+}
+
+/**
+ * Compares the kd-tree that used to index grid nodes with the spatial
+ * hash on node insertion and on lookups within the cell radius, which
+ * is what getNodeByLocation() does for every tracked player each frame.
+ */
+static void benchNodeIndex(const std::string &name, const std::vector<Vector3f> &locations, int count, boost::mt19937 &gen)
+{
+  boost::uniform_int<> pick(0, locations.size() - 1);
+  boost::variate_generator<boost::mt19937&, boost::uniform_int<> > die(gen, pick);
+  boost::uniform_real<float> offset(-Grid::cell_radius, Grid::cell_radius);
+  boost::variate_generator<boost::mt19937&, boost::uniform_real<float> > jitter(gen, offset);
+  std::vector<Vector3f> queries(count);
+  for (int i = 0; i < count; i++) {
+    queries[i] = locations[die()] + Vector3f(jitter(), jitter(), jitter());
+  }
+
+  // Both indices get single inserts as they do during play
+  GridTree tree(std::ptr_fun(waypoint_coordinate));
+  GridSpatialHash hash(Grid::cell_radius);
+  double t0 = now();
+  for (size_t i = 0; i < locations.size(); i++) {
+    tree.insert(GridWaypoint(locations[i], i));
+  }
+  double t1 = now();
+  for (size_t i = 0; i < locations.size(); i++) {
+    hash.insert(GridWaypoint(locations[i], i));
+  }
+  double t2 = now();
+
+  std::vector<int> treeFound(count), hashFound(count);
+  double t3 = now();
+  for (int i = 0; i < count; i++) {
+    std::pair<GridTree::const_iterator, float> found = tree.find_nearest(GridWaypoint(queries[i]), Grid::cell_radius);
+    treeFound[i] = found.first != tree.end() ? found.first->getIndex() : -1;
+  }
+  double t4 = now();
+  for (int i = 0; i < count; i++) {
+    hashFound[i] = hash.findNearest(queries[i], Grid::cell_radius);
+  }
+  double t5 = now();
+
+  // Equally distant nodes may legitimately differ, so compare distances
+  int differences = 0;
+  for (int i = 0; i < count; i++) {
+    float a = treeFound[i] == -1 ? -1.0 : (locations[treeFound[i]] - queries[i]).norm();
+    float b = hashFound[i] == -1 ? -1.0 : (locations[hashFound[i]] - queries[i]).norm();
+    if (std::abs(a - b) > 1e-3)
+      differences++;
+  }
+
+  std::cout << name << " (" << locations.size() << " nodes)" << std::endl;
+  std::cout << "  KDTree insert:          " << locations.size() / (t1 - t0) << " nodes/s" << std::endl;
+  std::cout << "  GridSpatialHash insert: " << locations.size() / (t2 - t1) << " nodes/s" << std::endl;
+  std::cout << "  KDTree lookup:          " << count / (t4 - t3) << " queries/s" << std::endl;
+  std::cout << "  GridSpatialHash lookup: " << count / (t5 - t4) << " queries/s" << std::endl;
+  std::cout << "  Different results: " << differences << " of " << count << std::endl;
+}
+
+/**
+ * Runs the node index benchmark on the learned grid and on a synthetic
+ * grid of 100k nodes laid out like a multi-floor map.
+ */
+static void benchNodeIndex(const std::vector<Vector3f> &locations, int count, boost::mt19937 &gen)
+{
+  benchNodeIndex("Learned grid", locations, count, gen);
+
+  boost::uniform_real<float> offset(-8.0, 8.0);
+  boost::variate_generator<boost::mt19937&, boost::uniform_real<float> > jitter(gen, offset);
+  std::vector<Vector3f> synthetic;
+  synthetic.reserve(100000);
+  for (int floor = 0; floor < 10; floor++) {
+    for (int x = 0; x < 100; x++) {
+      for (int y = 0; y < 100; y++) {
+        synthetic.push_back(Vector3f(x * Grid::sample_spacing + jitter(), y * Grid::sample_spacing + jitter(), floor * 128.0));
+      }
+    }
+  }
+
+  benchNodeIndex("Synthetic grid", synthetic, count, gen);
+}
+
+/**
+ * Hivemind benchmark entry point.
+ */
+int main(int argc, char **argv)
+{
+  // Parse program options
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "show help message")
+    ("benchmark", po::value<std::string>()->default_value("raytest"), "benchmark to run (raytest, raycache, findpath, gridpath, nearest, nodeindex)")
+    ("data-dir", po::value<std::string>()->default_value("data"), "learned data directory")
+    ("quake2-dir", po::value<std::string>()->default_value("/usr/share/games/quake2"), "specify quake2 directory")
+    ("map", po::value<std::string>()->default_value("maps/q2dm1.bsp"), "map to benchmark on")
+    ("count", po::value<int>()->default_value(1000000), "number of queries")
+    ("quantum", po::value<float>()->default_value(4.0), "ray cache quantum")
+  ;
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (std::exception &e) {
+    std::cout << "ERROR: There is an error in your syntax!" << std::endl;
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  // Display help when requested
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  Context context(
+    "hbench",
+    vm["quake2-dir"].as<std::string>(),
+    vm["data-dir"].as<std::string>(),
+    "male/flak",
+    "exploit",
+    "default",
+    "force"
+  );
+
+  // Load the map and the learned grid for query locations
+  std::string mapName = vm["map"].as<std::string>();
+  Map map(&context, mapName);
+  if (!map.open()) {
+    std::cout << "ERROR: Unable to open map " << mapName << "!" << std::endl;
+    return 1;
+  }
+
+  Grid grid(&map);
+  std::string mn = std::string(basename(mapName.c_str()));
+  mn = mn.substr(0, mn.find("."));
+  grid.importGrid(vm["data-dir"].as<std::string>() + "/grid-" + mn + ".hm");
+
+  LocationCollector collector;
+  grid.exportGrid(&collector);
+  if (collector.locations.empty()) {
+    std::cout << "ERROR: No grid locations available for " << mapName << "!" << std::endl;
+    return 1;
+  }
+
+  boost::mt19937 gen;
+  std::string benchmark = vm["benchmark"].as<std::string>();
+  int count = vm["count"].as<int>();
+  if (benchmark == "raytest") {
+    benchRayTest(&map, collector.locations, count, gen);
+  } else if (benchmark == "raycache") {
+    benchRayCache(&map, collector.locations, count, vm["quantum"].as<float>(), gen);
+  } else if (benchmark == "findpath") {
+    benchFindPath(&map, count, gen);
+  } else if (benchmark == "gridpath") {
+    benchGridPath(&grid, collector.locations, count, gen);
+  } else if (benchmark == "nearest") {
+    benchNearestNode(&grid, collector.locations, count, gen);
+  } else if (benchmark == "nodeindex") {
+    benchNodeIndex(collector.locations, count, gen);
+  } else {
+    std::cout << "ERROR: Unknown benchmark " << benchmark << "!" << std::endl;
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
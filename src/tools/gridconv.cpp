@@ -0,0 +1,89 @@
+/*
+ * This file is part of HiveMind distributed Quake 2 bot.
+ *
+ * Copyright (C) 2010 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2010 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ * Copyright (C) 2010 by Grega Kespret <grega.kespret@gmail.com>
+ */
+#include "context.h"
+#include "mapping/map.h"
+#include "mapping/grid.h"
+#include "mapping/exporters.h"
+
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+using namespace HiveMind;
+namespace po = boost::program_options;
+
+/**
+ * Grid converter entry point.
+ */
+int main(int argc, char **argv)
+{
+  // Parse program options
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "show help message")
+    ("data-dir", po::value<std::string>()->default_value("data"), "learned data directory")
+    ("quake2-dir", po::value<std::string>()->default_value("/usr/share/games/quake2"), "specify quake2 directory")
+    ("map", po::value<std::string>()->default_value("maps/q2dm1.bsp"), "map the grid belongs to")
+    ("input", po::value<std::string>(), "input filename (defaults to the text grid in data directory)")
+    ("output", po::value<std::string>(), "output filename (defaults to the binary grid in data directory)")
+  ;
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (std::exception &e) {
+    std::cout << "ERROR: There is an error in your syntax!" << std::endl;
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  // Display help when requested
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  Context context(
+    "hgridconv",
+    vm["quake2-dir"].as<std::string>(),
+    vm["data-dir"].as<std::string>(),
+    "male/flak",
+    "exploit",
+    "default",
+    "force"
+  );
+
+  // Map is needed to evaluate node media of text grids
+  std::string mapName = vm["map"].as<std::string>();
+  Map map(&context, mapName);
+  if (!map.open()) {
+    std::cout << "ERROR: Unable to open map " << mapName << "!" << std::endl;
+    return 1;
+  }
+
+  std::string mn = std::string(basename(mapName.c_str()));
+  mn = mn.substr(0, mn.find("."));
+  std::string gridFilename = vm["data-dir"].as<std::string>() + "/grid-" + mn;
+  std::string input = vm.count("input") ? vm["input"].as<std::string>() : gridFilename + ".hm";
+  std::string output = vm.count("output") ? vm["output"].as<std::string>() : gridFilename + ".hmb";
+
+  if (!boost::filesystem::exists(input)) {
+    std::cout << "ERROR: Grid " << input << " does not exist!" << std::endl;
+    return 1;
+  }
+
+  Grid grid(&map);
+  grid.importGrid(input);
+
+  BinaryGridExporter exporter(output);
+  grid.exportGrid(&exporter);
+  std::cout << "Grid " << input << " converted to " << output << "." << std::endl;
+  return 0;
+}